@@ -0,0 +1,1088 @@
+#include "tcpconn.h"
+
+#define perf_bps(bytes, ts) ((bytes) * 8 / (ts.tv_sec + ts.tv_nsec / 1000000000.0))
+#define perf_eps(events, ts) ((events) / (ts.tv_sec + ts.tv_nsec / 1000000000.0))
+
+// Agents are driven by one reactor: explicit state machines over epoll, and a timer heap
+
+#define AGENT_EVENTS 1024
+#define AGENT_BURST_MAX (64 * 1048576)
+#define RETRY_NS 1000000000ULL
+
+typedef enum { OP_CONNECT, OP_SEND, OP_WAIT, OP_DISCONNECT, OP_LOOP, OP_EXIT } op_t;
+
+typedef enum {
+    ST_IDLE,        // Waiting for a timer, or runnable
+    ST_CONNECT,     // Non-blocking connect() in progress
+    ST_HELLO,       // Sending HC_STARTUP
+    ST_ACK,         // Waiting for HC_ACK
+    ST_SEND,        // Sending a burst
+    ST_DONE
+} state_t;
+
+typedef struct step_t {
+    op_t op;
+    uint64_t n_min;             // Messages per burst
+    uint64_t n_max;
+    unsigned long size;         // Message size
+    uint64_t d_min;             // Wait, or burst period (ns)
+    uint64_t d_max;
+    uint64_t for_min;           // Burst duration (ns), 0 for one burst
+    uint64_t for_max;
+    char * block;               // n_max framed messages, shared by every agent
+} step_t;
+
+typedef struct group_t {
+    unsigned long count;
+    step_t * steps;
+    int nsteps;
+    int loop;                   // First step of the repeating part
+} group_t;
+
+typedef struct agent_t {
+    int sock;
+    int heap_pos;               // -1 if no timer is pending
+    uint16_t group;
+    uint8_t state;
+    uint8_t handshaked;
+    uint16_t step;
+    uint32_t seed;
+    uint32_t offset;            // Bytes sent (or received, waiting for HC_ACK)
+    uint32_t length;            // Bytes to send
+    uint64_t due;               // Timer deadline (ns)
+    uint64_t until;             // End of the current burst step (ns)
+    uint64_t started;           // Connection start, for the handshake latency (ns)
+} agent_t;
+
+static int debug_flag;
+static int verbose_flag;
+static volatile int running = 1;
+static char * ip = "127.0.0.1";
+static in_port_t port = DEF_PORT;
+static struct in_addr * sources;
+static int nsources;
+static int force_connection;
+static sockopts_t sockopts;
+static struct timespec watch_interval;
+static uint64_t duration;
+static unsigned int seed;
+static group_t * groups;
+static int ngroups;
+static agent_t * agents;
+static unsigned long nagents;
+static unsigned long * heap;
+static unsigned long heap_len;
+static int epfd;
+static char hello[64];
+static unsigned long hello_len;
+static char drain[65536];
+
+// Statistics
+static unsigned long connected;
+static size_t connects;
+static size_t handshakes;
+static size_t failures;         // Connections refused or lost
+static size_t disconnects;
+static size_t msgs;
+static size_t bytes;
+static size_t push_bytes;
+static size_t timers;
+static size_t io_events;
+static uint64_t busy_ns;
+static latency_t timer_lag;
+static latency_t handshake_latency;
+
+static void handler(int signum) {
+    debug("%s received (%d)", strsignal(signum), signum);
+
+    switch (signum) {
+    case SIGINT:
+        putchar('\n');
+        running = 0;
+        break;
+
+    case SIGPIPE:
+        break;
+
+    default:
+        error("Unknown signal %d (%s).", signum, strsignal(signum));
+    }
+}
+
+void help(const char * argv0, int result) {
+    print("Syntax: %s [ -B <IP>[,<IP>...] ] [ -d ] [ -e <line> ] [ -f ] [ -F <file> ] [ -h ] [ -i <IP> ] [ -o <opt>[=<n>] ] [ -p <port> ] [ -r <seed> ] [ -t <sec> ] [ -v ] [ -w <sec> ]", argv0);
+    print("");
+    print("    -B <IPs>    Local addresses to connect from, shared round-robin by the agents.");
+    print("                Each one has its own range of ephemeral ports.");
+    print("    -d          Debug mode.");
+    print("    -e <line>   Scenario line (may be repeated).");
+    print("    -f          Force connection (don't wait for the handshake ACK).");
+    print("    -F <file>   Scenario file.");
+    print("    -h          This help.");
+    print("    -i <IP>     Server IP address.");
+    print("    -o <opt>    Socket option, may be repeated: rcvbuf=<bytes>, sndbuf=<bytes>, busy_poll=<us>,");
+    print("                nodelay, cork, notsent_lowat=<bytes>.");
+    print("    -p <port>   Port number.");
+    print("    -r <seed>   Random seed. Default: current time.");
+    print("    -t <sec>    Stop after <sec> seconds. Default: run until interrupted.");
+    print("    -v          Verbose mode (show messages).");
+    print("    -w <sec>    Enable watcher with interval of <sec> seconds.");
+    print("");
+    print("Scenario: one group of agents per line, '#' starts a comment.");
+    print("");
+    print("    <count>: <step>; <step>; ...");
+    print("");
+    print("    connect                         Connect and handshake (sending connects too).");
+    print("    send <n>x<size> [every <t>] [for <t>]");
+    print("                                    Send a burst of <n> messages, periodically if given.");
+    print("    wait <t>                        Stay idle (connected or not).");
+    print("    disconnect                      Close the connection.");
+    print("    loop                            At the end, repeat from here (default: from the start).");
+    print("    exit                            Stop the agent.");
+    print("");
+    print("Numbers and times may be ranges, drawn per agent and step: 'wait 1s-5s', 'send 1-10x512'.");
+    print("Times take a unit (us, ms, s, m); milliseconds by default.");
+    print("");
+    print("Default: 1000: wait 0-1s; loop; connect; send 10x512 every 100ms for 10s; wait 1s-5s; disconnect; wait 1s");
+    exit(result);
+}
+
+static uint32_t agent_random(agent_t * agent) {
+    // xorshift32
+    agent->seed ^= agent->seed << 13;
+    agent->seed ^= agent->seed >> 17;
+    agent->seed ^= agent->seed << 5;
+    return agent->seed;
+}
+
+static uint64_t agent_range(agent_t * agent, uint64_t min, uint64_t max) {
+    return max > min ? min + ((uint64_t)agent_random(agent) << 32 | agent_random(agent)) % (max - min + 1) : min;
+}
+
+// Parse "<n>[-<m>]", with an optional time unit (a bare minimum takes the unit of the maximum).
+// Returns a pointer past the value, or NULL on error.
+
+static const char * parse_range(const char * p, uint64_t * min, uint64_t * max, int time) {
+    const char * units[] = { "us", "ms", "s", "m" };
+    const uint64_t scales[] = { 1000, 1000000, 1000000000, 60000000000 };
+    uint64_t * values[] = { min, max };
+    int unit[2] = { -1, -1 };
+    char * end;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (*values[i] = strtoull(p, &end, 10), end == p) {
+            return NULL;
+        }
+
+        if (time) {
+            for (unit[i] = 0; unit[i] < 4 && strncmp(end, units[unit[i]], strlen(units[unit[i]])); unit[i]++);
+            end += unit[i] < 4 ? strlen(units[unit[i]]) : 0;
+        }
+
+        if (i == 0 && *end != '-') {
+            unit[1] = unit[0];
+            *max = *min;
+            break;
+        }
+
+        p = end + 1;
+    }
+
+    if (time) {
+        unit[0] = unit[0] < 4 ? unit[0] : unit[1];
+        *min *= scales[unit[0] < 4 ? unit[0] : 1];
+        *max *= scales[unit[1] < 4 ? unit[1] : 1];
+    }
+
+    return *max >= *min ? end : NULL;
+}
+
+// Parse one scenario line. Returns 0 on success, or -1 on error.
+
+static int parse_line(char * line) {
+    group_t * group;
+    step_t * step;
+    char * colon;
+    char * token;
+    char * saveptr;
+    const char * p;
+    uint64_t size;
+    unsigned long i;
+    char * end;
+
+    if (line[strcspn(line, "#\n")] = '\0', line[strspn(line, " \t")] == '\0') {
+        return 0;
+    }
+
+    if (colon = strchr(line, ':'), !colon) {
+        error("Scenario: missing ':' in '%s'.", line);
+        return -1;
+    }
+
+    groups = realloc(groups, sizeof(group_t) * (ngroups + 1));
+    group = groups + ngroups++;
+    memset(group, 0, sizeof(group_t));
+
+    if (group->count = strtoul(line, &end, 10), end == line || !group->count) {
+        error("Scenario: bad agent count in '%s'.", line);
+        return -1;
+    }
+
+    for (token = strtok_r(colon + 1, ";", &saveptr); token; token = strtok_r(NULL, ";", &saveptr)) {
+        token += strspn(token, " \t");
+
+        if (!*token) {
+            continue;
+        }
+
+        group->steps = realloc(group->steps, sizeof(step_t) * (group->nsteps + 1));
+        step = group->steps + group->nsteps++;
+        memset(step, 0, sizeof(step_t));
+        p = NULL;
+
+        if (strncmp(token, "connect", 7) == 0) {
+            step->op = OP_CONNECT;
+            p = token + 7;
+        } else if (strncmp(token, "disconnect", 10) == 0) {
+            step->op = OP_DISCONNECT;
+            p = token + 10;
+        } else if (strncmp(token, "loop", 4) == 0) {
+            step->op = OP_LOOP;
+            group->loop = group->nsteps - 1;
+            p = token + 4;
+        } else if (strncmp(token, "exit", 4) == 0) {
+            step->op = OP_EXIT;
+            p = token + 4;
+        } else if (strncmp(token, "wait ", 5) == 0) {
+            step->op = OP_WAIT;
+            p = parse_range(token + 5, &step->d_min, &step->d_max, 1);
+        } else if (strncmp(token, "send ", 5) == 0) {
+            step->op = OP_SEND;
+
+            if (p = parse_range(token + 5, &step->n_min, &step->n_max, 0), p && *p == 'x' && step->n_min) {
+                if (size = strtoull(p + 1, &end, 10), end == p + 1 || !size || size >= 2000000000 || (size + sizeof(uint32_t)) * step->n_max > AGENT_BURST_MAX) {
+                    p = NULL;
+                } else {
+                    step->size = size;
+                    p = end + strspn(end, " \t");
+
+                    if (strncmp(p, "every ", 6) == 0) {
+                        p = parse_range(p + 6, &step->d_min, &step->d_max, 1);
+                        p = p ? p + strspn(p, " \t") : NULL;
+
+                        if (p && strncmp(p, "for ", 4) == 0) {
+                            p = parse_range(p + 4, &step->for_min, &step->for_max, 1);
+                        } else if (p) {
+                            step->for_min = step->for_max = UINT64_MAX;
+                        }
+                    }
+                }
+            } else {
+                p = NULL;
+            }
+        }
+
+        if (!p || p[strspn(p, " \t")]) {
+            error("Scenario: bad step '%s'.", token);
+            return -1;
+        }
+
+        // Bursts are prepared once: agents send a prefix of the block
+
+        if (step->op == OP_SEND) {
+            char * message;
+
+            step->block = malloc((step->size + sizeof(uint32_t)) * step->n_max);
+
+            for (i = 0; i < step->n_max; i++) {
+                message = step->block + i * (step->size + sizeof(uint32_t));
+                *(uint32_t *)message = step->size;
+
+                for (size = 0; size < step->size; size++) {
+                    message[sizeof(uint32_t) + size] = 'a' + random() % 26;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < (unsigned long)group->nsteps; i++) {
+        if (group->steps[i].op != OP_LOOP && group->steps[i].op != OP_DISCONNECT) {
+            break;
+        }
+    }
+
+    if (i == (unsigned long)group->nsteps) {
+        error("Scenario: line '%s' has nothing to do.", line);
+        return -1;
+    }
+
+    nagents += group->count;
+    return 0;
+}
+
+static int parse_file(const char * path) {
+    char line[BUF_SIZE];
+    FILE * fp;
+    int retval = 0;
+
+    if (fp = fopen(path, "r"), !fp) {
+        error2("fopen(%s)", path);
+        return -1;
+    }
+
+    while (retval == 0 && fgets(line, sizeof(line), fp)) {
+        retval = parse_line(line);
+    }
+
+    fclose(fp);
+    return retval;
+}
+
+static void options(int argc, char * const argv[]) {
+    int c;
+    long ms;
+    int _port;
+    double seconds;
+    char * token;
+    char * saveptr;
+
+    while (c = getopt(argc, argv, "B:de:fF:hi:o:p:r:t:vw:"), c != -1) {
+        switch (c) {
+        case 'B':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            for (token = strtok_r(optarg, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+                sources = realloc(sources, sizeof(struct in_addr) * (nsources + 1));
+
+                if (!inet_aton(token, sources + nsources++)) {
+                    error("Invalid IP '%s'", token);
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            break;
+
+        case 'd':
+            debug_flag = 1;
+            break;
+
+        case 'e':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (parse_line(optarg) < 0) {
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+
+        case 'f':
+            force_connection = 1;
+            break;
+
+        case 'F':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (parse_file(optarg) < 0) {
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+
+        case 'h':
+            help(argv[0], 0);
+
+        case 'i':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            ip = optarg;
+            break;
+
+        case 'o':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (so_parse(&sockopts, optarg) < 0) {
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+
+        case 'p':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (_port = atoi(optarg), _port <= 0) {
+                error("Option -%c needs a positive argument.", c);
+                continue;
+            }
+
+            port = (in_port_t)_port;
+            break;
+
+        case 'r':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            seed = strtoul(optarg, NULL, 10);
+            break;
+
+        case 't':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (seconds = atof(optarg), seconds <= 0) {
+                error("Option -%c needs a positive argument.", c);
+                continue;
+            }
+
+            duration = seconds * 1000000000;
+            break;
+
+        case 'v':
+            verbose_flag = 1;
+            break;
+
+        case 'w':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (seconds = atof(optarg), seconds <= 0) {
+                error("Option -%c needs a positive argument.", c);
+                continue;
+            }
+
+            ms = seconds * 1000;
+            watch_interval.tv_sec = ms / 1000;
+            watch_interval.tv_nsec = (ms % 1000) * 1000000;
+            break;
+
+        default:
+            help(argv[0], 1);
+        }
+    }
+}
+
+// Timer heap: a binary min-heap of agent indexes, ordered by deadline
+
+static void heap_swap(unsigned long i, unsigned long j) {
+    unsigned long tmp = heap[i];
+
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    agents[heap[i]].heap_pos = i;
+    agents[heap[j]].heap_pos = j;
+}
+
+static void heap_up(unsigned long i) {
+    for (; i > 0 && agents[heap[i]].due < agents[heap[(i - 1) / 2]].due; i = (i - 1) / 2) {
+        heap_swap(i, (i - 1) / 2);
+    }
+}
+
+static void heap_down(unsigned long i) {
+    unsigned long child;
+
+    for (; child = 2 * i + 1, child < heap_len; i = child) {
+        if (child + 1 < heap_len && agents[heap[child + 1]].due < agents[heap[child]].due) {
+            child++;
+        }
+
+        if (agents[heap[i]].due <= agents[heap[child]].due) {
+            break;
+        }
+
+        heap_swap(i, child);
+    }
+}
+
+static void timer_set(unsigned long id, uint64_t due) {
+    agent_t * agent = agents + id;
+
+    agent->due = due;
+
+    if (agent->heap_pos < 0) {
+        agent->heap_pos = heap_len;
+        heap[heap_len++] = id;
+        heap_up(agent->heap_pos);
+    } else {
+        heap_up(agent->heap_pos);
+        heap_down(agent->heap_pos);
+    }
+}
+
+static void timer_cancel(unsigned long id) {
+    unsigned long i = agents[id].heap_pos;
+    unsigned long last;
+
+    if (agents[id].heap_pos < 0) {
+        return;
+    }
+
+    agents[id].heap_pos = -1;
+
+    if (i < --heap_len) {
+        last = heap[heap_len];
+        heap[i] = last;
+        agents[last].heap_pos = i;
+        heap_up(i);
+        heap_down(agents[last].heap_pos);
+    }
+}
+
+static unsigned long timer_pop() {
+    unsigned long id = heap[0];
+
+    timer_cancel(id);
+    return id;
+}
+
+static int agent_watch(unsigned long id, int op, uint32_t events) {
+    struct epoll_event request = { .events = events, .data = { .u64 = id } };
+
+    if (epoll_ctl(epfd, op, agents[id].sock, &request) < 0) {
+        error2("epoll_ctl(%d)", agents[id].sock);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void agent_close(unsigned long id) {
+    agent_t * agent = agents + id;
+
+    if (agent->sock >= 0) {
+        close(agent->sock);
+        agent->sock = -1;
+    }
+
+    if (agent->handshaked) {
+        agent->handshaked = 0;
+        connected--;
+    }
+
+    agent->state = ST_IDLE;
+}
+
+// The connection failed or was lost: retry the current step later
+
+static void agent_fail(unsigned long id, const char * what) {
+    verbose("Agent %lu: %s.", id, what);
+    failures++;
+    agent_close(id);
+    agents[id].until = 0;
+    timer_set(id, now_ns() + RETRY_NS);
+}
+
+static void agent_connect(unsigned long id) {
+    agent_t * agent = agents + id;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr = { .s_addr = 0 } };
+
+    inet_aton(ip, &addr.sin_addr);
+    agent->started = now_ns();
+    connects++;
+
+    if (agent->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP), agent->sock < 0) {
+        agent_fail(id, "socket() failed");
+        return;
+    }
+
+    if (so_apply(&sockopts, agent->sock, 1) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Let the kernel pick the port at connect(), so that every source address has its own range
+
+    if (nsources) {
+        struct sockaddr_in local = { .sin_family = AF_INET, .sin_addr = sources[id % nsources] };
+
+        setsockopt(agent->sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &(int){ 1 }, sizeof(int));
+
+        if (bind(agent->sock, (struct sockaddr *)&local, sizeof(local)) < 0) {
+            agent_fail(id, "bind() failed");
+            return;
+        }
+    }
+
+    if (connect(agent->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        agent_fail(id, "connect() failed");
+        return;
+    }
+
+    agent->state = ST_CONNECT;
+    agent->offset = 0;
+
+    if (agent_watch(id, EPOLL_CTL_ADD, EPOLLOUT) < 0) {
+        agent_fail(id, "epoll_ctl() failed");
+    }
+}
+
+// Send the pending part of data. Returns 1 when it is all sent, 0 if the socket is full, or -1 on error.
+
+static int agent_write(unsigned long id, const char * data) {
+    agent_t * agent = agents + id;
+    ssize_t nsend;
+
+    while (agent->offset < agent->length) {
+        if (nsend = send(agent->sock, data + agent->offset, agent->length - agent->offset, MSG_NOSIGNAL), nsend < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        agent->offset += nsend;
+        bytes += nsend;
+    }
+
+    return 1;
+}
+
+// Run the script of an agent until it blocks on a timer or on the network, or for one pass of its loop.
+// A loop that goes round without blocking or sending (e.g. "connect; loop") parks the agent instead of spinning.
+
+static void agent_run(unsigned long id) {
+    agent_t * agent = agents + id;
+    group_t * group = groups + agent->group;
+    step_t * step;
+    uint64_t now;
+    unsigned long n;
+    int wrapped = 0;
+    int idle = 0;
+
+    while (running) {
+        if (agent->step == group->nsteps) {
+            if (idle) {
+                verbose("Agent %lu: parked, its loop neither waits nor sends.", id);
+                agent->state = ST_IDLE;
+                return;
+            }
+
+            // Sending as fast as the socket takes it: yield to the event loop after each pass
+
+            if (wrapped) {
+                timer_set(id, now_ns());
+                return;
+            }
+
+            agent->step = group->loop;
+            wrapped = 1;
+            idle = 1;
+        }
+
+        step = group->steps + agent->step;
+
+        switch (step->op) {
+        case OP_CONNECT:
+            if (!agent->handshaked) {
+                agent_connect(id);
+                return;
+            }
+
+            agent->step++;
+            break;
+
+        case OP_SEND:
+            if (!agent->handshaked) {
+                agent_connect(id);
+                return;
+            }
+
+            now = now_ns();
+
+            if (!agent->until) {
+                agent->due = now;
+                agent->until = step->for_max == UINT64_MAX ? UINT64_MAX : now + agent_range(agent, step->for_min, step->for_max);
+            }
+
+            n = agent_range(agent, step->n_min, step->n_max);
+            agent->offset = 0;
+            agent->length = n * (step->size + sizeof(uint32_t));
+            msgs += n;
+
+            switch (agent_write(id, step->block)) {
+            case -1:
+                agent_fail(id, "connection lost while sending");
+                return;
+
+            case 0:
+                agent->state = ST_SEND;
+                agent_watch(id, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+                return;
+            }
+
+            idle = 0;
+
+            // Periodic bursts keep their pace even if a burst is delayed
+
+            if (step->d_max && agent->due + step->d_min < agent->until) {
+                timer_set(id, agent->due + agent_range(agent, step->d_min, step->d_max));
+                return;
+            }
+
+            agent->until = 0;
+            agent->step++;
+            break;
+
+        case OP_WAIT:
+            agent->step++;
+            timer_set(id, now_ns() + agent_range(agent, step->d_min, step->d_max));
+            return;
+
+        case OP_DISCONNECT:
+            if (agent->sock >= 0) {
+                disconnects++;
+                agent_close(id);
+            }
+
+            agent->step++;
+            break;
+
+        case OP_LOOP:
+            agent->step++;
+            break;
+
+        case OP_EXIT:
+            agent_close(id);
+            agent->state = ST_DONE;
+            return;
+        }
+    }
+}
+
+// The connection is ready: the handshake is complete, or the server accepted it with -f
+
+static void agent_ready(unsigned long id) {
+    agent_t * agent = agents + id;
+
+    agent->handshaked = 1;
+    agent->state = ST_IDLE;
+    connected++;
+    handshakes++;
+    latency_add(&handshake_latency, now_ns() - agent->started);
+
+    if (agent_watch(id, EPOLL_CTL_MOD, EPOLLIN) == 0) {
+        agent_run(id);
+    }
+}
+
+static void agent_io(unsigned long id, uint32_t events) {
+    agent_t * agent = agents + id;
+    ssize_t nrecv;
+    int err = 0;
+
+    switch (agent->state) {
+    case ST_CONNECT:
+        if (getsockopt(agent->sock, SOL_SOCKET, SO_ERROR, &err, &(socklen_t){ sizeof(err) }) < 0 || err) {
+            agent_fail(id, "connection refused");
+            return;
+        }
+
+        agent->state = ST_HELLO;
+        agent->offset = 0;
+        agent->length = hello_len;
+        // Fallthrough
+
+    case ST_HELLO:
+        switch (agent_write(id, hello)) {
+        case -1:
+            agent_fail(id, "connection lost in handshake");
+            return;
+
+        case 0:
+            return;
+        }
+
+        if (force_connection) {
+            agent_ready(id);
+            return;
+        }
+
+        agent->state = ST_ACK;
+        agent->offset = 0;
+        agent_watch(id, EPOLL_CTL_MOD, EPOLLIN);
+        return;
+
+    case ST_ACK: {
+        char ack[sizeof(uint32_t) + 16];
+        size_t expected = sizeof(uint32_t) + strlen(HC_ACK);
+
+        // The ACK is small: peek until it is complete, then consume it
+
+        if (nrecv = recv(agent->sock, ack, expected, MSG_PEEK), nrecv <= 0) {
+            if (nrecv < 0 && errno == EAGAIN) {
+                return;
+            }
+
+            agent_fail(id, "connection lost in handshake");
+            return;
+        }
+
+        if ((size_t)nrecv < expected) {
+            return;
+        }
+
+        if (recv(agent->sock, ack, expected, 0), *(uint32_t *)ack != strlen(HC_ACK) || strncmp(ack + sizeof(uint32_t), HC_ACK, strlen(HC_ACK))) {
+            agent_fail(id, "bad handshake ACK");
+            return;
+        }
+
+        agent_ready(id);
+        return;
+    }
+
+    case ST_SEND:
+        if (events & EPOLLOUT) {
+            switch (agent_write(id, groups[agent->group].steps[agent->step].block)) {
+            case -1:
+                agent_fail(id, "connection lost while sending");
+                return;
+
+            case 1: {
+                step_t * step = groups[agent->group].steps + agent->step;
+
+                agent->state = ST_IDLE;
+                agent_watch(id, EPOLL_CTL_MOD, EPOLLIN);
+
+                if (step->d_max && agent->due + step->d_min < agent->until) {
+                    timer_set(id, agent->due + agent_range(agent, step->d_min, step->d_max));
+                } else {
+                    agent->until = 0;
+                    agent->step++;
+                    agent_run(id);
+                }
+
+                return;
+            }
+            }
+        }
+
+        if (!(events & ~EPOLLOUT)) {
+            return;
+        }
+
+        // Fallthrough
+
+    default:
+        // Connected: discard whatever the server pushes
+
+        while (nrecv = recv(agent->sock, drain, sizeof(drain), 0), nrecv > 0) {
+            push_bytes += nrecv;
+        }
+
+        if (nrecv == 0 || errno != EAGAIN) {
+            timer_cancel(id);
+            agent_fail(id, "connection lost");
+        }
+    }
+}
+
+static void report(const struct timespec * c_diff, const struct rusage * usage) {
+    double cpu = usage->ru_utime.tv_sec + usage->ru_stime.tv_sec + (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1000000.0;
+    double wall = c_diff->tv_sec + c_diff->tv_nsec / 1000000000.0;
+    size_t operations = timers + io_events;
+
+    info("Agents: %lu in %d groups (%zu bytes of state each).", nagents, ngroups, sizeof(agent_t));
+    info("Connections: %zu attempts, %zu handshakes, %zu failed or lost, %zu closed by the script.", connects, handshakes, failures, disconnects);
+    info("Data sent: %zu messages, %zu MB (%f Mbps, %f Keps).", msgs, bytes / 1000000, perf_bps(bytes, (*c_diff)) / 1000000, perf_eps(msgs / 1000.0, (*c_diff)));
+
+    if (push_bytes) {
+        info("Data received from the server: %zu MB.", push_bytes / 1000000);
+    }
+
+    if (handshake_latency.total) {
+        info("Handshake latency: p50 %.1f us, p99 %.1f us, max %.1f us.", latency_quantile(&handshake_latency, 0.5), latency_quantile(&handshake_latency, 0.99), handshake_latency.max / 1000.0);
+    }
+
+    // Simulator overhead: if the loop is always busy or timers fire late, the agents are not keeping their pace
+
+    info("Simulator: %zu timers, %zu I/O events, %.1f%% busy, %.1f%% CPU, %.0f ns per operation.", timers, io_events, busy_ns / 10000000.0 / wall, cpu * 100 / wall, operations ? busy_ns / (double)operations : 0);
+
+    if (timer_lag.total) {
+        info("Timer lag: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us.", latency_quantile(&timer_lag, 0.5), latency_quantile(&timer_lag, 0.99), latency_quantile(&timer_lag, 0.999), timer_lag.max / 1000.0);
+
+        if (busy_ns > wall * 900000000) {
+            warn("The simulator is saturated: results are bounded by the simulator, not the server.");
+        } else if (latency_quantile(&timer_lag, 0.99) > 1000) {
+            warn("Timers fire late, but the loop is mostly idle: the simulator is short of CPU.");
+        }
+    }
+}
+
+int main(int argc, char ** argv) {
+    struct epoll_event events[AGENT_EVENTS];
+    struct rlimit limit;
+    struct rusage usage;
+    struct timespec c_begin;
+    struct timespec c_end;
+    struct timespec c_diff;
+    uint64_t now;
+    uint64_t begin;
+    uint64_t watch_next = UINT64_MAX;
+    uint64_t watch_ns = 0;
+    size_t msgs_old = 0;
+    size_t bytes_old = 0;
+    uint64_t busy_old = 0;
+    unsigned long id;
+    unsigned long i;
+    struct timespec timeout;
+    int nevents;
+    int g;
+
+    seed = time(NULL);
+    options(argc, argv);
+    signal(SIGINT, handler);
+    signal(SIGPIPE, handler);
+
+    if (!ngroups) {
+        char line[] = "1000: wait 0-1s; loop; connect; send 10x512 every 100ms for 10s; wait 1s-5s; disconnect; wait 1s";
+
+        parse_line(line);
+    }
+
+    // One socket per agent
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < nagents + 64) {
+        limit.rlim_cur = limit.rlim_max < nagents + 64 ? limit.rlim_max : nagents + 64;
+
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < nagents + 64) {
+            warn("Only %lu file descriptors available for %lu agents.", (unsigned long)limit.rlim_cur, nagents);
+        }
+    }
+
+    hello_len = sizeof(uint32_t) + strlen(HC_STARTUP);
+    *(uint32_t *)hello = strlen(HC_STARTUP);
+    memcpy(hello + sizeof(uint32_t), HC_STARTUP, strlen(HC_STARTUP));
+
+    agents = calloc(nagents, sizeof(agent_t));
+    heap = malloc(sizeof(unsigned long) * nagents);
+
+    if (epfd = epoll_create1(0), epfd < 0) {
+        error2("epoll_create1()");
+        return EXIT_FAILURE;
+    }
+
+    // Every agent starts runnable
+
+    begin = now_ns();
+
+    for (id = 0, g = 0; g < ngroups; g++) {
+        for (i = 0; i < groups[g].count; i++, id++) {
+            agents[id].sock = -1;
+            agents[id].heap_pos = -1;
+            agents[id].group = g;
+            agents[id].seed = (seed ^ (id * 2654435761U)) | 1;
+            timer_set(id, begin);
+        }
+    }
+
+    info("Running %lu agents in %d groups.", nagents, ngroups);
+    clock_gettime(CLOCK_MONOTONIC, &c_begin);
+
+    if (watch_interval.tv_sec || watch_interval.tv_nsec) {
+        watch_ns = watch_interval.tv_sec * 1000000000ULL + watch_interval.tv_nsec;
+        watch_next = begin + watch_ns;
+    }
+
+    while (running) {
+        now = now_ns();
+
+        if (duration && now - begin >= duration) {
+            break;
+        }
+
+        // Sleep until the next timer, the watcher or the end, whatever comes first
+
+        {
+            uint64_t next = heap_len ? agents[heap[0]].due : UINT64_MAX;
+
+            next = watch_next < next ? watch_next : next;
+            next = duration && begin + duration < next ? begin + duration : next;
+            next = next > now ? next - now : 0;
+            timeout.tv_sec = next / 1000000000;
+            timeout.tv_nsec = next % 1000000000;
+        }
+
+        if (nevents = epoll_pwait2(epfd, events, AGENT_EVENTS, heap_len || watch_ns || duration ? &timeout : NULL, NULL), nevents < 0) {
+            if (errno != EINTR) {
+                error2("epoll_wait()");
+            }
+
+            continue;
+        }
+
+        now = now_ns();
+
+        for (i = 0; i < (unsigned long)nevents; i++) {
+            io_events++;
+            agent_io(events[i].data.u64, events[i].events);
+        }
+
+        while (running && heap_len && agents[heap[0]].due <= now) {
+            id = timer_pop();
+            latency_add(&timer_lag, now - agents[id].due);
+            timers++;
+
+            if (agents[id].state == ST_IDLE) {
+                agent_run(id);
+            }
+        }
+
+        busy_ns += now_ns() - now;
+
+        if (now >= watch_next) {
+            c_diff.tv_sec = (now - watch_next + watch_ns) / 1000000000;
+            c_diff.tv_nsec = (now - watch_next + watch_ns) % 1000000000;
+            printf("\r\e[2KConnected: %lu/%lu. Sent: %.1f Keps, %.3f Mbps. Busy: %.1f%%. Timer lag: p99 %.1f us", connected, nagents, perf_eps((msgs - msgs_old) / 1000.0, c_diff), perf_bps(bytes - bytes_old, c_diff) / 1000000, (busy_ns - busy_old) / 10000000.0 / (c_diff.tv_sec + c_diff.tv_nsec / 1000000000.0), latency_quantile(&timer_lag, 0.99));
+            fflush(stdout);
+            msgs_old = msgs;
+            bytes_old = bytes;
+            busy_old = busy_ns;
+            watch_next = now + watch_ns;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &c_end);
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (watch_ns) {
+        putchar('\n');
+    }
+
+    c_diff.tv_sec = c_end.tv_sec - c_begin.tv_sec;
+    c_diff.tv_nsec = c_end.tv_nsec - c_begin.tv_nsec;
+
+    if (c_diff.tv_nsec < 0) {
+        c_diff.tv_sec--;
+        c_diff.tv_nsec += 1000000000;
+    }
+
+    report(&c_diff, &usage);
+
+    for (id = 0; id < nagents; id++) {
+        agent_close(id);
+    }
+
+    close(epfd);
+    verbose("Exiting.");
+    return EXIT_SUCCESS;
+}
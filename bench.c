@@ -0,0 +1,517 @@
+#include "tcpconn.h"
+
+// Offline benchmark of the framing layer (nb_reserve + nb_frame): streams are fed from memory, as recv() would.
+// The server's dispatch() is replaced by a counting callback: its handshake check and counters are not measured.
+
+#define STREAM_MAX (4 * 1048576)
+#define CASE_BYTES (256 * 1048576UL)
+#define LIST_MAX 16
+#define PERF_COUNTERS 3
+
+typedef enum { SPLIT_READ, SPLIT_ALIGNED, SPLIT_HEADER, SPLIT_PAYLOAD } split_t;
+
+static const char * SPLIT_NAMES[] = { "read", "aligned", "header", "payload" };
+
+static int debug_flag;
+static unsigned long sizes[LIST_MAX] = { 16, 64, 256, 1024, 4096, 16384 };
+static int nsizes = 6;
+static unsigned long chunks[LIST_MAX] = { BUF_SIZE };
+static int nchunks = 1;
+static unsigned long batches[LIST_MAX] = { 1, 8, 64 };
+static int nbatches = 3;
+static unsigned long nevents = 1000000;
+static unsigned long fuzz_rounds;
+static unsigned int seed;
+static int perf_fds[PERF_COUNTERS] = { -1, -1, -1 };
+
+// Benchmark sink
+static size_t events;
+static size_t sink;
+static size_t copied;       // Bytes copied into the buffer by the reads
+
+// Fuzz state: the expected messages, and a digest of what the framing produced
+static char ** fuzz_data;
+static uint32_t * fuzz_sizes;
+static unsigned long fuzz_count;
+static unsigned long fuzz_next;
+static unsigned long fuzz_fail;     // Message whose callback fails (1-based), or 0
+static size_t fuzz_errors;
+static uint64_t fuzz_digest = 14695981039346656037ULL;
+
+void help(const char * argv0, int result) {
+    print("Syntax: %s [ -b <list> ] [ -c <list> ] [ -d ] [ -f <n> ] [ -h ] [ -n <n> ] [ -r <seed> ] [ -s <list> ]", argv0);
+    print("");
+    print("    -b <list>   Messages per read for the aligned, header and payload splits. Default: 1,8,64.");
+    print("    -c <list>   Read sizes for the read split. Default: %d.", BUF_SIZE);
+    print("    -d          Debug mode.");
+    print("    -f <n>      Fuzz: check the framing output on <n> random streams, and print its digest.");
+    print("    -h          This help.");
+    print("    -n <n>      Events per case (at most 256 MB of data). Default: 1000000.");
+    print("    -r <seed>   Random seed. Default: 1.");
+    print("    -s <list>   Message sizes. Default: 16,64,256,1024,4096,16384.");
+    print("");
+    print("Splits: 'read' cuts the stream in fixed reads, 'aligned' reads whole messages, 'header' cuts");
+    print("every read inside a header, and 'payload' cuts it in the middle of a payload.");
+    exit(result);
+}
+
+static int parse_list(const char * arg, unsigned long * list) {
+    const char * p = arg;
+    char * end;
+    int n = 0;
+
+    while (*p && n < LIST_MAX) {
+        if (list[n] = strtoul(p, &end, 10), end == p || !list[n]) {
+            return -1;
+        }
+
+        n++;
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return *p ? -1 : n;
+}
+
+static void options(int argc, char * const argv[]) {
+    int c;
+
+    seed = 1;
+
+    while (c = getopt(argc, argv, "b:c:df:hn:r:s:"), c != -1) {
+        switch (c) {
+        case 'b':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (nbatches = parse_list(optarg, batches), nbatches < 0) {
+                error("Option -%c needs a list of positive numbers.", c);
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+
+        case 'c':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (nchunks = parse_list(optarg, chunks), nchunks < 0) {
+                error("Option -%c needs a list of positive numbers.", c);
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+
+        case 'd':
+            debug_flag = 1;
+            break;
+
+        case 'f':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (fuzz_rounds = strtoul(optarg, NULL, 10), !fuzz_rounds) {
+                error("Option -%c needs a positive argument.", c);
+                continue;
+            }
+
+            break;
+
+        case 'h':
+            help(argv[0], 0);
+
+        case 'n':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (nevents = strtoul(optarg, NULL, 10), !nevents) {
+                error("Option -%c needs a positive argument.", c);
+                nevents = 1000000;
+                continue;
+            }
+
+            break;
+
+        case 'r':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            seed = strtoul(optarg, NULL, 10);
+            break;
+
+        case 's':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (nsizes = parse_list(optarg, sizes), nsizes < 0) {
+                error("Option -%c needs a list of positive numbers.", c);
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+
+        default:
+            help(argv[0], 1);
+        }
+    }
+}
+
+// Hardware counters for this thread: cycles, instructions and cache misses, as one group
+
+static void perf_init() {
+    const uint64_t configs[PERF_COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES };
+    struct perf_event_attr attr;
+    int i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        if (perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i ? perf_fds[0] : -1, 0), perf_fds[i] < 0) {
+            debug("perf_event_open(%d): %s", i, strerror(errno));
+
+            while (i-- > 0) {
+                close(perf_fds[i]);
+                perf_fds[i] = -1;
+            }
+
+            warn("Hardware counters not available.");
+            return;
+        }
+    }
+}
+
+static void perf_start() {
+    if (perf_fds[0] >= 0) {
+        ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+static int perf_stop(uint64_t * values) {
+    struct {
+        uint64_t nr;
+        uint64_t values[PERF_COUNTERS];
+    } group;
+
+    if (perf_fds[0] < 0) {
+        return -1;
+    }
+
+    ioctl(perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    if (read(perf_fds[0], &group, sizeof(group)) != sizeof(group) || group.nr != PERF_COUNTERS) {
+        return -1;
+    }
+
+    memcpy(values, group.values, sizeof(group.values));
+    return 0;
+}
+
+// Copy the next read into the buffer, as recv() would, wrapping around the stream
+
+static void feed(sockbuffer_t * buffer, const char * stream, unsigned long length, unsigned long * offset, unsigned long chunk) {
+    unsigned long part;
+
+    nb_reserve(buffer, chunk);
+
+    while (chunk > 0) {
+        part = length - *offset < chunk ? length - *offset : chunk;
+        memcpy(buffer->data + buffer->data_len, stream + *offset, part);
+        buffer->data_len += part;
+        copied += part;
+        *offset = (*offset + part) % length;
+        chunk -= part;
+    }
+}
+
+static int bench_event(int sock, char * data, unsigned long size) {
+    (void)sock;
+    (void)data;
+    events++;
+    sink += size;
+    return 0;
+}
+
+// Run one case, and print a table row
+
+static void bench_case(unsigned long size, split_t split, unsigned long param) {
+    unsigned long frame = size + sizeof(uint32_t);
+    unsigned long count = (STREAM_MAX / frame) ? STREAM_MAX / frame : 1;
+    unsigned long length = count * frame;
+    unsigned long target = nevents < CASE_BYTES / frame ? nevents : CASE_BYTES / frame;
+    unsigned long chunk;
+    unsigned long offset = 0;
+    unsigned long i;
+    sockbuffer_t buffer = { .data = NULL };
+    nb_stats_t stats;
+    size_t copied_begin;
+    uint64_t counters[PERF_COUNTERS];
+    uint64_t begin;
+    uint64_t elapsed;
+    char * stream = malloc(length);
+    char cell[3][32];
+
+    for (i = 0; i < count; i++) {
+        *(uint32_t *)(stream + i * frame) = size;
+        memset(stream + i * frame + sizeof(uint32_t), 'a' + i % 26, size);
+    }
+
+    // Reads of whole messages, after a first read that leaves every cut at the same point
+
+    chunk = split == SPLIT_READ ? param : param * frame;
+
+    switch (split) {
+    case SPLIT_HEADER:
+        feed(&buffer, stream, length, &offset, sizeof(uint32_t) / 2);
+        break;
+
+    case SPLIT_PAYLOAD:
+        feed(&buffer, stream, length, &offset, sizeof(uint32_t) + size / 2);
+        break;
+
+    default:
+        break;
+    }
+
+    // Warm up, then measure
+
+    for (events = 0; events < target / 10 + 1;) {
+        feed(&buffer, stream, length, &offset, chunk);
+        nb_frame(&buffer, -1, bench_event);
+    }
+
+    stats = nb_stats;
+    copied_begin = copied;
+    events = 0;
+    begin = now_ns();
+    perf_start();
+
+    while (events < target) {
+        feed(&buffer, stream, length, &offset, chunk);
+        nb_frame(&buffer, -1, bench_event);
+    }
+
+    elapsed = now_ns() - begin;
+
+    if (perf_stop(counters) == 0) {
+        snprintf(cell[0], sizeof(cell[0]), "%.1f", (double)counters[0] / events);
+        snprintf(cell[1], sizeof(cell[1]), "%.2f", counters[0] ? (double)counters[1] / counters[0] : 0);
+        snprintf(cell[2], sizeof(cell[2]), "%.4f", (double)counters[2] / events);
+    } else {
+        strcpy(cell[0], "-");
+        strcpy(cell[1], "-");
+        strcpy(cell[2], "-");
+    }
+
+    print("|%lu|%s %lu|%.1f|%.3f|%.3f|%.1f|%.1f|%.4f|%s|%s|%s|", size, SPLIT_NAMES[split], param, (double)elapsed / events, events * 1000.0 / elapsed, events * frame * 8.0 / elapsed, (double)(copied - copied_begin + nb_stats.moved - stats.moved) / events, (double)(nb_stats.moved - stats.moved) / events, (double)(nb_stats.allocs - stats.allocs) / events, cell[0], cell[1], cell[2]);
+
+    free(buffer.data);
+    free(stream);
+}
+
+static void bench() {
+    int s;
+    int j;
+
+    perf_init();
+    info("Framing benchmark: %lu events per case (reads are copied into the buffer, as recv() does; messages go to a counting callback, not dispatch()).", nevents);
+    print("|Bytes / event|Split|ns / event|Meps|Gbps|Bytes copied / event|Bytes moved / event|Allocations / event|Cycles / event|IPC|Cache misses / event|");
+    print("|---|---|---|---|---|---|---|---|---|---|---|");
+
+    for (s = 0; s < nsizes; s++) {
+        for (j = 0; j < nchunks; j++) {
+            bench_case(sizes[s], SPLIT_READ, chunks[j]);
+        }
+
+        for (j = 0; j < nbatches; j++) {
+            bench_case(sizes[s], SPLIT_ALIGNED, batches[j]);
+            bench_case(sizes[s], SPLIT_HEADER, batches[j]);
+            bench_case(sizes[s], SPLIT_PAYLOAD, batches[j]);
+        }
+    }
+}
+
+// Check each message against the expected one, in order
+
+static int fuzz_event(int sock, char * data, unsigned long size) {
+    unsigned long i;
+
+    (void)sock;
+
+    if (fuzz_next >= fuzz_count || size != fuzz_sizes[fuzz_next] || memcmp(data, fuzz_data[fuzz_next], size)) {
+        error("Fuzz: message %lu differs (size %lu, expected %u).", fuzz_next, size, fuzz_next < fuzz_count ? fuzz_sizes[fuzz_next] : 0);
+        fuzz_errors++;
+    }
+
+    // FNV-1a over sizes and contents
+
+    for (i = 0; i < sizeof(uint32_t); i++) {
+        fuzz_digest = (fuzz_digest ^ ((size >> (i * 8)) & 0xff)) * 1099511628211ULL;
+    }
+
+    for (i = 0; i < size; i++) {
+        fuzz_digest = (fuzz_digest ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+
+    return ++fuzz_next == fuzz_fail ? -1 : 0;
+}
+
+static unsigned long fuzz_size() {
+    switch (random() % 6) {
+    case 0:
+        return 0;
+
+    case 1:
+        return 1 + random() % 8;
+
+    case 2:
+        return 9 + random() % 512;
+
+    case 3:
+        return BUF_SIZE - 8 + random() % 16;
+
+    case 4:
+        return random() % (3 * BUF_SIZE);
+
+    default:
+        return random() % 2048;
+    }
+}
+
+static unsigned long fuzz_chunk() {
+    switch (random() % 4) {
+    case 0:
+        return 1 + random() % 4;
+
+    case 1:
+        return 1 + random() % 64;
+
+    case 2:
+        return 1 + random() % (2 * BUF_SIZE);
+
+    default:
+        return BUF_SIZE;
+    }
+}
+
+// One random stream, with an optional partial message at the end, fed in random reads
+
+static void fuzz_round() {
+    unsigned long length = 0;
+    unsigned long offset = 0;
+    unsigned long tail;
+    unsigned long chunk;
+    unsigned long i;
+    unsigned long j;
+    sockbuffer_t buffer = { .data = NULL };
+    char * stream;
+    int retval = 0;
+
+    fuzz_count = 1 + random() % 200;
+    fuzz_data = malloc(sizeof(char *) * fuzz_count);
+    fuzz_sizes = malloc(sizeof(uint32_t) * fuzz_count);
+
+    for (i = 0; i < fuzz_count; i++) {
+        fuzz_sizes[i] = fuzz_size();
+        length += sizeof(uint32_t) + fuzz_sizes[i];
+    }
+
+    // The partial message keeps a header that announces more than what follows
+
+    tail = random() % 2 ? 1 + random() % 64 : 0;
+    stream = malloc(length + tail + sizeof(uint32_t));
+
+    for (i = 0, length = 0; i < fuzz_count; i++) {
+        *(uint32_t *)(stream + length) = fuzz_sizes[i];
+        fuzz_data[i] = stream + length + sizeof(uint32_t);
+
+        for (j = 0; j < fuzz_sizes[i]; j++) {
+            fuzz_data[i][j] = random();
+        }
+
+        length += sizeof(uint32_t) + fuzz_sizes[i];
+    }
+
+    if (tail) {
+        *(uint32_t *)(stream + length) = tail + random() % 4096;
+
+        for (j = sizeof(uint32_t); j < tail; j++) {
+            stream[length + j] = random();
+        }
+
+        length += tail;
+    }
+
+    fuzz_next = 0;
+    fuzz_fail = random() % 8 ? 0 : 1 + random() % fuzz_count;
+
+    while (offset < length && !retval) {
+        if (chunk = fuzz_chunk(), chunk > length - offset) {
+            chunk = length - offset;
+        }
+
+        nb_reserve(&buffer, chunk);
+        memcpy(buffer.data + buffer.data_len, stream + offset, chunk);
+        buffer.data_len += chunk;
+        offset += chunk;
+        retval = nb_frame(&buffer, -1, fuzz_event);
+    }
+
+    // A failing callback stops dispatching right there. Otherwise every message is seen, and only the tail is left.
+
+    if (fuzz_fail) {
+        if (retval != -1 || fuzz_next != fuzz_fail) {
+            error("Fuzz: callback failure at message %lu not reported (returned %d after %lu messages).", fuzz_fail, retval, fuzz_next);
+            fuzz_errors++;
+        }
+    } else if (fuzz_next != fuzz_count || buffer.data_len != tail || memcmp(buffer.data, stream + length - tail, tail)) {
+        error("Fuzz: %lu of %lu messages dispatched, %lu bytes left (expected %lu).", fuzz_next, fuzz_count, buffer.data_len, tail);
+        fuzz_errors++;
+    }
+
+    free(buffer.data);
+    free(stream);
+    free(fuzz_data);
+    free(fuzz_sizes);
+}
+
+static int fuzz() {
+    unsigned long i;
+
+    for (i = 0; i < fuzz_rounds; i++) {
+        fuzz_round();
+    }
+
+    info("Fuzz: %lu streams, %zu errors. Framing digest (seed %u): %016llx", fuzz_rounds, fuzz_errors, seed, (unsigned long long)fuzz_digest);
+    return fuzz_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char ** argv) {
+    options(argc, argv);
+    srandom(seed);
+
+    if (fuzz_rounds) {
+        return fuzz();
+    }
+
+    bench();
+    return EXIT_SUCCESS;
+}
@@ -11,6 +11,26 @@ static int sock = -1;
 static in_port_t port = DEF_PORT;
 static struct timeval timeout;
 static int force_connection;
+static int tls_flag;
+static int ktls_flag;
+static SSL_CTX * tls_ctx;
+static SSL * ssl;
+static SSL_SESSION * tls_session;
+static int tls_resume = 1;
+static long handshakes;
+static int udp_flag;
+static int udp_gso;
+static int udp_batch = 1;
+static int udp_events = 1;
+static size_t udp_datagrams;
+static size_t udp_errors;
+static sockopts_t sockopts;
+static sockbuffer_t pushes;
+static size_t push_count;
+static size_t push_bytes;
+
+// With no message latency, look for pushes once every PUSH_CHECK messages
+#define PUSH_CHECK 64
 
 static void handler(int signum) {
     debug("%s received (%d)", strsignal(signum), signum);
@@ -29,17 +49,26 @@ static void handler(int signum) {
 }
 
 void help(const char * argv0, int result) {
-    print("Syntax: %s [ -d ] [ -f ] [ -h ] [ -i <IP> ] [ -n <host> ] [ -p <port> ] [ -s <size> ] [ -t <ms> ] [ -v ]", argv0);
+    print("Syntax: %s [ -d ] [ -e <n> ] [ -f ] [ -g ] [ -h ] [ -H <n> ] [ -i <IP> ] [ -K ] [ -m <n> ] [ -n <host> ] [ -o <opt>[=<n>] ] [ -p <port> ] [ -s <size> ] [ -t <ms> ] [ -T ] [ -U ] [ -v ]", argv0);
     print("");
     print("    -d          Debug mode.");
+    print("    -e <n>      UDP mode: messages per datagram. Default: 1.");
     print("    -f          Force connection (no handshake).");
+    print("    -g          UDP mode: send each batch as one buffer segmented by the kernel (UDP_SEGMENT).");
     print("    -h          This help.");
+    print("    -H <n>      Handshake benchmark: run <n> full (and <n> resumed, with TLS) handshakes and exit.");
     print("    -i <IP>     IP address.");
+    print("    -K          Enable kernel TLS offload (if available).");
     print("    -l <ms>     Message latency. Default: 10 ms.");
+    print("    -m <n>      UDP mode: datagrams per sendmmsg() call. Default: 1.");
     print("    -n <host>   Hostname (instead of IP).");
+    print("    -o <opt>    Socket option, may be repeated: rcvbuf=<bytes>, sndbuf=<bytes>, busy_poll=<us>,");
+    print("                nodelay, cork, notsent_lowat=<bytes>.");
     print("    -p <port>   Port number.");
     print("    -s <size>   Message size. Default: 1024 bytes.");
     print("    -t <ms>     Sending timeout. Default: infinity.");
+    print("    -T          Connect using TLS.");
+    print("    -U          UDP mode (instead of TCP).");
     print("    -v          Verbose mode (show messages).");
     exit(result);
 }
@@ -50,19 +79,50 @@ static void options(int argc, char * const argv[]) {
     int _port;
     int size;
 
-    while (c = getopt(argc, argv, "dfhi:l:n:p:s:t:v"), c != -1) {
+    while (c = getopt(argc, argv, "de:fghH:i:Kl:m:n:o:p:s:t:TUv"), c != -1) {
         switch (c) {
         case 'd':
             debug_flag = 1;
             break;
 
+        case 'e':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (udp_events = atoi(optarg), udp_events <= 0) {
+                error("Option -%c needs a positive argument.", c);
+                udp_events = 1;
+                continue;
+            }
+
+            break;
+
         case 'f':
             force_connection = 1;
             break;
 
+        case 'g':
+            udp_gso = 1;
+            break;
+
         case 'h':
             help(argv[0], 0);
 
+        case 'H':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (handshakes = atol(optarg), handshakes <= 0) {
+                error("Option -%c needs a positive argument.", c);
+                continue;
+            }
+
+            break;
+
         case 'i':
             if (!optarg) {
                 error("Option -%c needs an argument.", c);
@@ -72,6 +132,10 @@ static void options(int argc, char * const argv[]) {
             ip = optarg;
             break;
 
+        case 'K':
+            ktls_flag = 1;
+            break;
+
         case 'l':
             if (!optarg) {
                 error("Option -%c needs an argument.", c);
@@ -88,6 +152,20 @@ static void options(int argc, char * const argv[]) {
 
             break;
 
+        case 'm':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (udp_batch = atoi(optarg), udp_batch <= 0 || udp_batch > UDP_BATCH) {
+                error("Option -%c needs an argument between 1 and %d.", c, UDP_BATCH);
+                udp_batch = 1;
+                continue;
+            }
+
+            break;
+
         case 'n':
             if (!optarg) {
                 error("Option -%c needs an argument.", c);
@@ -97,6 +175,18 @@ static void options(int argc, char * const argv[]) {
             hostname = optarg;
             break;
 
+        case 'o':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (so_parse(&sockopts, optarg) < 0) {
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+
         case 'p':
             if (!optarg) {
                 error("Option -%c needs an argument.", c);
@@ -144,6 +234,14 @@ static void options(int argc, char * const argv[]) {
 
             break;
 
+        case 'T':
+            tls_flag = 1;
+            break;
+
+        case 'U':
+            udp_flag = 1;
+            break;
+
         case 'v':
             verbose_flag = 1;
             break;
@@ -154,51 +252,225 @@ static void options(int argc, char * const argv[]) {
     }
 }
 
-void server_connect() {
-    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr = { .s_addr = 0 } };
-    struct hostent * host;
+// Keep the last session ticket received from the server for resumption
 
-    debug("server_connect()");
+static int tls_new_session(SSL * s, SSL_SESSION * session) {
+    (void)s;
+
+    debug("New TLS session ticket.");
+
+    if (tls_session) {
+        SSL_SESSION_free(tls_session);
+    }
+
+    tls_session = session;
+    return 1;
+}
+
+static SSL_CTX * tls_init() {
+    SSL_CTX * ctx;
+
+    if (ctx = SSL_CTX_new(TLS_client_method()), !ctx) {
+        error_tls("SSL_CTX_new()");
+        return NULL;
+    }
+
+    // The server uses a self-signed certificate: no peer verification
+
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+
+    if (ktls_flag) {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+
+    return ctx;
+}
+
+static void tls_close() {
+    if (ssl) {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        ssl = NULL;
+    }
+}
+
+// Returns 0 on success or -1 on error (the connection must be restarted)
+
+static int tls_connect() {
+    int ret;
 
-    if (sock >= 0) {
-        debug("close()");
-        close(sock);
+    if (ssl = SSL_new(tls_ctx), !ssl) {
+        error_tls("SSL_new()");
+        exit(EXIT_FAILURE);
     }
 
-    debug("socket()");
-    if (sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP), sock < 0) {
-        error2("socket()");
+    // Handshake flights and records are small writes: don't let Nagle delay them
+
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int)) < 0) {
+        error2("setsockopt(TCP_NODELAY)");
         exit(EXIT_FAILURE);
     }
 
-    if (timeout.tv_sec || timeout.tv_usec) {
-        debug("setsockopt(SO_SNDTIMEO)");
+    SSL_set_fd(ssl, sock);
+
+    if (tls_resume && tls_session) {
+        SSL_set_session(ssl, tls_session);
+    }
+
+    debug("SSL_connect()");
+    ERR_clear_error();
+
+    if (ret = SSL_connect(ssl), ret != 1) {
+        warn_tls("SSL_connect()");
+        SSL_free(ssl);
+        ssl = NULL;
+        return -1;
+    }
+
+    debug("TLS connection: %s, %s (%s)", SSL_get_version(ssl), SSL_get_cipher(ssl), SSL_session_reused(ssl) ? "resumed" : "full");
+
+    if (ktls_flag) {
+        debug("kTLS send: %s", BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "yes" : "no");
+    }
+
+    return 0;
+}
+
+// Send/receive through the current transport (plain socket or TLS)
+
+static ssize_t conn_send(const void * buf, size_t len) {
+    int ret;
+
+    if (!ssl) {
+        return send(sock, buf, len, 0);
+    }
+
+    ERR_clear_error();
+
+    if (ret = SSL_write(ssl, buf, len), ret <= 0) {
+        if (SSL_get_error(ssl, ret) != SSL_ERROR_SYSCALL) {
+            errno = EPROTO;
+        }
 
-        if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
-            error2("setsockopt(SO_SNDTIMEO)");
+        return -1;
+    }
+
+    return ret;
+}
+
+static ssize_t conn_recv(void * buf, size_t len) {
+    size_t total;
+    int ret;
+
+    if (!ssl) {
+        return recv(sock, buf, len, MSG_WAITALL);
+    }
+
+    for (total = 0; total < len; total += ret) {
+        ERR_clear_error();
+
+        if (ret = SSL_read(ssl, (char *)buf + total, len - total), ret <= 0) {
+            switch (SSL_get_error(ssl, ret)) {
+            case SSL_ERROR_ZERO_RETURN:
+                return total;
+
+            case SSL_ERROR_SYSCALL:
+                return errno ? -1 : (ssize_t)total;
+
+            default:
+                errno = EPROTO;
+                return -1;
+            }
+        }
+    }
+
+    return total;
+}
+
+// Resolve the server address. Returns 0 on success, or -1 to retry later.
+
+static int server_address(struct in_addr * addr) {
+    struct hostent * host;
+
+    if (hostname) {
+        debug("gethostbyname(%s)", hostname);
+
+        if (host = gethostbyname(hostname), !host) {
+            error("Hostname '%s' not resolved.", hostname);
+            return -1;
+        }
+
+        *addr = *((struct in_addr *)host->h_addr);
+
+        if (!handshakes) {
+            print("Trying to connect to '%s' (%s).", inet_ntoa(*addr), hostname);
+        }
+    } else {
+        if (!inet_aton(ip, addr)) {
+            error("Invalid IP '%s'", ip);
             exit(EXIT_FAILURE);
         }
+
+        if (!handshakes) {
+            print("Trying to connect to '%s'.", ip);
+        }
     }
 
+    return 0;
+}
+
+void server_connect() {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr = { .s_addr = 0 } };
+
+    debug("server_connect()");
+
+    pushes.data_len = 0;
+
     while (1) {
-        if (hostname) {
-            debug("gethostbyname(%s)", hostname);
+        tls_close();
 
-            if (host = gethostbyname(hostname), !host) {
-                error("Hostname '%s' not resolved.", hostname);
-                sleep(1);
-                continue;
+        if (sock >= 0) {
+            debug("close()");
+            close(sock);
+        }
+
+        debug("socket()");
+        if (sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP), sock < 0) {
+            error2("socket()");
+            exit(EXIT_FAILURE);
+        }
+
+        if (so_apply(&sockopts, sock, 1) < 0) {
+            exit(EXIT_FAILURE);
+        }
+
+        if (timeout.tv_sec || timeout.tv_usec) {
+            debug("setsockopt(SO_SNDTIMEO)");
+
+            if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+                error2("setsockopt(SO_SNDTIMEO)");
+                exit(EXIT_FAILURE);
             }
+        }
 
-            addr.sin_addr = *((struct in_addr *)host->h_addr);
-            print("Trying to connect to '%s' (%s).", inet_ntoa(addr.sin_addr), hostname);
-        } else {
-            if (!inet_aton(ip, &addr.sin_addr)) {
-                error("Invalid IP '%s'", ip);
+        if (handshakes) {
+            // Avoid exhausting ephemeral ports with TIME_WAIT sockets
+
+            struct linger linger = { 1, 0 };
+
+            if (setsockopt(sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) < 0) {
+                error2("setsockopt(SO_LINGER)");
                 exit(EXIT_FAILURE);
             }
+        }
 
-            print("Trying to connect to '%s'.", ip);
+        if (server_address(&addr.sin_addr) < 0) {
+            sleep(1);
+            continue;
         }
 
         debug("connect()");
@@ -208,6 +480,11 @@ void server_connect() {
             continue;
         }
 
+        if (tls_flag && tls_connect() < 0) {
+            sleep(1);
+            continue;
+        }
+
         debug("Connection stablished (not yet handshaked).");
         return;
     }
@@ -225,7 +502,7 @@ void server_handshake() {
         length = strlen(HC_STARTUP);
 
         debug("send(\"%u\")", length);
-        if (send(sock, (void *)&length, sizeof(length), 0) < 0) {
+        if (conn_send((void *)&length, sizeof(length)) < 0) {
             warn2("send(\"length(HC_STARTUP)\") [1]");
             sleep(1);
             server_connect();
@@ -233,7 +510,7 @@ void server_handshake() {
         }
 
         debug("send(\"%s\")", HC_STARTUP);
-        if (send(sock, HC_STARTUP, length, 0) < 0) {
+        if (conn_send(HC_STARTUP, length) < 0) {
             error2("send(\"HC_STARTUP\") [2]");
             sleep(1);
             server_connect();
@@ -241,13 +518,16 @@ void server_handshake() {
         }
 
         if (force_connection) {
-            print("Connected to server!");
+            if (!handshakes) {
+                print("Connected to server!");
+            }
+
             return;
         }
 
         debug("recv()");
 
-        switch (recv(sock, (void *)&length, sizeof(length), MSG_WAITALL)) {
+        switch (conn_recv((void *)&length, sizeof(length))) {
         case -1:
             error2("recv()");
             sleep(1);
@@ -261,7 +541,14 @@ void server_handshake() {
             continue;
 
         default:
-            nrecv = recv(sock, buffer, length, MSG_WAITALL);
+            if (length > BUF_SIZE) {
+                error("Message too long from server: %u bytes", length);
+                sleep(1);
+                server_connect();
+                continue;
+            }
+
+            nrecv = conn_recv(buffer, length);
 
             if (nrecv != (ssize_t)length) {
                 error("Incorrect message size from server: expecting %u, got %d", length, (int)nrecv);
@@ -274,7 +561,10 @@ void server_handshake() {
         if (strcmp(buffer, HC_ACK)) {
             error("recv(): expecting '%s', got '%s'", HC_ACK, buffer);
         } else {
-            print("Connected to server!");
+            if (!handshakes) {
+                print("Connected to server!");
+            }
+
             return;
         }
     }
@@ -293,9 +583,292 @@ void fill_random(char * buffer, size_t msg_size) {
     }
 }
 
+// Receive and count messages pushed by the server. Returns -1 if the connection was lost.
+
+static int push_read() {
+    ssize_t nrecv;
+    unsigned long i;
+    uint32_t length;
+
+    do {
+        if (pushes.data_len + BUF_SIZE > pushes.data_size) {
+            pushes.data_size = pushes.data_len + BUF_SIZE;
+            pushes.data = realloc(pushes.data, pushes.data_size);
+        }
+
+        if (ssl) {
+            ERR_clear_error();
+
+            if (nrecv = SSL_read(ssl, pushes.data + pushes.data_len, BUF_SIZE), nrecv <= 0) {
+                switch (SSL_get_error(ssl, nrecv)) {
+                case SSL_ERROR_WANT_READ:
+                    errno = EAGAIN;
+                    nrecv = -1;
+                    break;
+
+                case SSL_ERROR_ZERO_RETURN:
+                    nrecv = 0;
+                    break;
+
+                case SSL_ERROR_SYSCALL:
+                    nrecv = errno ? -1 : 0;
+                    break;
+
+                default:
+                    errno = EPROTO;
+                    nrecv = -1;
+                }
+            }
+        } else {
+            nrecv = recv(sock, pushes.data + pushes.data_len, BUF_SIZE, MSG_DONTWAIT);
+        }
+
+        if (nrecv <= 0) {
+            return nrecv < 0 && errno == EAGAIN ? 0 : -1;
+        }
+
+        pushes.data_len += nrecv;
+        push_bytes += nrecv;
+
+        for (i = 0; i + sizeof(uint32_t) <= pushes.data_len; i += sizeof(uint32_t) + length) {
+            length = *(uint32_t *)(pushes.data + i);
+
+            if (i + sizeof(uint32_t) + length > pushes.data_len) {
+                break;
+            }
+
+            ++push_count;
+            verbose("Push received: %.*s (%u bytes)", length < 20 ? (int)length : 20, pushes.data + i + sizeof(uint32_t), length);
+        }
+
+        if (i > 0) {
+            memmove(pushes.data, pushes.data + i, pushes.data_len - i);
+            pushes.data_len -= i;
+        }
+    } while (ssl ? SSL_pending(ssl) > 0 : nrecv == BUF_SIZE);
+
+    return 0;
+}
+
+// Wait for the message latency while receiving pushes. Returns -1 if the connection was lost.
+
+static int push_wait(const struct timespec * delay) {
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    struct timespec c_end;
+    struct timespec c_now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &c_end);
+    c_end.tv_sec += delay->tv_sec;
+
+    if (c_end.tv_nsec += delay->tv_nsec, c_end.tv_nsec >= 1000000000) {
+        c_end.tv_sec++;
+        c_end.tv_nsec -= 1000000000;
+    }
+
+    do {
+        if (ssl && SSL_pending(ssl) > 0 && push_read() < 0) {
+            return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &c_now);
+        ms = (c_end.tv_sec - c_now.tv_sec) * 1000 + (c_end.tv_nsec - c_now.tv_nsec + 999999) / 1000000;
+
+        switch (poll(&pfd, 1, ms > 0 ? ms : 0)) {
+        case -1:
+            if (errno != EINTR) {
+                warn2("poll()");
+            }
+
+            break;
+
+        case 0:
+            return 0;
+
+        default:
+            if (push_read() < 0) {
+                return -1;
+            }
+        }
+    } while (ms > 0);
+
+    return 0;
+}
+
+static void push_report() {
+    info("Pushes received: %zu messages, %zu KB.", push_count, push_bytes / 1000);
+}
+
+// Measure connection setup: TCP connect, TLS handshake (if enabled) and HC_STARTUP/HC_ACK
+
+static double handshake_round(int resume) {
+    struct timespec c_begin;
+    struct timespec c_end;
+    long i;
+
+    tls_resume = resume;
+    clock_gettime(CLOCK_MONOTONIC, &c_begin);
+
+    for (i = 0; i < handshakes; i++) {
+        server_connect();
+        server_handshake();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &c_end);
+    return handshakes / ((c_end.tv_sec - c_begin.tv_sec) + (c_end.tv_nsec - c_begin.tv_nsec) / 1000000000.0);
+}
+
+static void handshake_bench() {
+    info("Full handshakes: %f per second.", handshake_round(0));
+
+    if (tls_flag) {
+        // Make sure that a session ticket is available
+
+        server_connect();
+        server_handshake();
+
+        info("Resumed handshakes: %f per second.", handshake_round(1));
+
+        if (!SSL_session_reused(ssl)) {
+            warn("Sessions were not resumed by the server.");
+        }
+    }
+
+    tls_close();
+    close(sock);
+}
+
+static void udp_report() {
+    info("UDP: %zu datagrams, %zu messages sent. Send errors: %zu.", udp_datagrams, udp_datagrams * udp_events, udp_errors);
+}
+
+// UDP mode: send batches of datagrams, each with a sequence number and udp_events messages
+
+static int udp_main() {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr = { .s_addr = 0 } };
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    size_t dgram_size = sizeof(udp_header_t) + udp_events * (sizeof(uint32_t) + msg_size);
+    uint32_t agent;
+    uint32_t seq = 0;
+    char * buffer;
+    char * event;
+    int nsent;
+    int mtu;
+    int last_errno = 0;
+    int i;
+    int j;
+
+    if (dgram_size > UDP_MAX) {
+        error("Datagram too large: %zu bytes (maximum: %d).", dgram_size, UDP_MAX);
+        return EXIT_FAILURE;
+    }
+
+    if (udp_gso && udp_batch * dgram_size > UDP_MAX) {
+        udp_batch = UDP_MAX / dgram_size;
+        warn("Batch reduced to %d datagrams to fit a GSO buffer.", udp_batch);
+    }
+
+    srandom(time(NULL) ^ getpid());
+    agent = random();
+    buffer = malloc(udp_batch * dgram_size + 1);
+    memset(msgs, 0, sizeof(msgs));
+
+    for (i = 0; i < udp_batch; i++) {
+        ((udp_header_t *)(buffer + i * dgram_size))->agent = agent;
+
+        for (j = 0; j < udp_events; j++) {
+            event = buffer + i * dgram_size + sizeof(udp_header_t) + j * (sizeof(uint32_t) + msg_size);
+            *(uint32_t *)event = msg_size;
+            snprintf(event + sizeof(uint32_t), msg_size, "%u: ", agent);
+            fill_random(event + sizeof(uint32_t), msg_size);
+        }
+
+        iovs[i].iov_base = buffer + i * dgram_size;
+        iovs[i].iov_len = dgram_size;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (server_address(&addr.sin_addr) < 0) {
+        sleep(1);
+    }
+
+    debug("socket(UDP)");
+    if (sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP), sock < 0) {
+        error2("socket(UDP)");
+        return EXIT_FAILURE;
+    }
+
+    if (so_apply(&sockopts, sock, 0) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (udp_gso && setsockopt(sock, SOL_UDP, UDP_SEGMENT, &(int){ dgram_size }, sizeof(int)) < 0) {
+        error2("setsockopt(UDP_SEGMENT)");
+        return EXIT_FAILURE;
+    }
+
+    debug("connect()");
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        error2("connect()");
+        return EXIT_FAILURE;
+    }
+
+    // Each GSO segment must fit the route MTU with its IPv4 and UDP headers (28 bytes), or every send fails.
+    // Loopback has a 64 KiB MTU.
+
+    if (udp_gso && getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &(socklen_t){ sizeof(mtu) }) == 0 && dgram_size + 28 > (size_t)mtu) {
+        error("Option -g: datagrams of %zu bytes do not fit the path MTU (%d bytes). Use fewer or smaller messages (-e, -s).", dgram_size, mtu);
+        return EXIT_FAILURE;
+    }
+
+    atexit(udp_report);
+
+    while (1) {
+        // Datagrams that could not be sent keep their sequence number
+
+        for (i = 0; i < udp_batch; i++) {
+            ((udp_header_t *)(buffer + i * dgram_size))->seq = seq + i;
+        }
+
+        if (udp_gso) {
+            nsent = send(sock, buffer, udp_batch * dgram_size, 0) < 0 ? -1 : udp_batch;
+        } else if (udp_batch == 1) {
+            nsent = send(sock, buffer, dgram_size, 0) < 0 ? -1 : 1;
+        } else {
+            nsent = sendmmsg(sock, msgs, udp_batch, 0);
+        }
+
+        // Report each new kind of error once: a persistent one would otherwise only show in the final count
+
+        if (nsent < 0) {
+            if (errno != last_errno) {
+                warn2("send()");
+                last_errno = errno;
+            } else {
+                debug("send(): %s (%d)", strerror(errno), errno);
+            }
+
+            udp_errors++;
+        } else {
+            verbose("Sent %d datagrams: %.80s", nsent, buffer + sizeof(udp_header_t) + sizeof(uint32_t));
+            seq += nsent;
+            udp_datagrams += nsent;
+        }
+
+        if (delay.tv_sec || delay.tv_nsec) {
+            nanosleep(&delay, NULL);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char ** argv) {
     pid_t pid;
     int size;
+    unsigned long nsent = 0;
     ssize_t nsend;
     uint32_t length;
     char * buffer;
@@ -304,6 +877,25 @@ int main(int argc, char ** argv) {
     signal(SIGINT, handler);
     signal(SIGPIPE, handler);
 
+    if (udp_flag) {
+        if (tls_flag || handshakes) {
+            error("TLS and handshakes are not available in UDP mode.");
+            return EXIT_FAILURE;
+        }
+
+        return udp_main();
+    }
+
+    if (tls_flag && (tls_ctx = tls_init(), !tls_ctx)) {
+        return EXIT_FAILURE;
+    }
+
+    if (handshakes) {
+        handshake_bench();
+        return EXIT_SUCCESS;
+    }
+
+    atexit(push_report);
     server_connect();
     server_handshake();
     srandom(time(NULL));
@@ -324,7 +916,7 @@ int main(int argc, char ** argv) {
     while (1) {
         debug("send()");
 
-        nsend = send(sock, buffer, length, 0);
+        nsend = conn_send(buffer, length);
 
         if (nsend < 0) {
             if (errno == EPIPE) {
@@ -339,8 +931,9 @@ int main(int argc, char ** argv) {
         } else {
             verbose("Sent: %.80s", buffer + sizeof(uint32_t));
 
-            if (delay.tv_sec || delay.tv_nsec) {
-                nanosleep(&delay, NULL);
+            if ((delay.tv_sec || delay.tv_nsec || ++nsent % PUSH_CHECK == 0) && push_wait(&delay) < 0) {
+                print("Connection lost [2].");
+                server_handshake();
             }
         }
     }
@@ -1,9 +1,10 @@
 #include "tcpconn.h"
 
-#define perf_bps(bytes, ts) (bytes * 8 / (ts.tv_sec + ts.tv_nsec / 1000000000.0))
-#define perf_eps(events, ts) (events / (ts.tv_sec + ts.tv_nsec / 1000000000.0))
+#define perf_bps(bytes, ts) ((bytes) * 8 / (ts.tv_sec + ts.tv_nsec / 1000000000.0))
+#define perf_eps(events, ts) ((events) / (ts.tv_sec + ts.tv_nsec / 1000000000.0))
 
 static volatile int running = 1;
+static volatile int restart;
 static int debug_flag;
 static int verbose_flag;
 static struct timespec delay;
@@ -15,6 +16,79 @@ static netbuffer_t netbuffer;
 static int nconn;
 static struct timespec c_begin;
 static struct timespec watch_interval;
+static int tls_flag;
+static int ktls_flag;
+static const char * tls_cert;
+static const char * tls_key;
+static SSL_CTX * tls_ctx;
+static volatile size_t tls_full;
+static volatile size_t tls_resumed;
+static size_t tls_ktls;
+static volatile size_t tls_bytes;
+static volatile size_t tls_events;
+static size_t tls_conns;
+static size_t bulk_conns[2];    // Connections that carried data: plaintext, TLS
+static size_t bulk_bytes[2];
+static double bulk_seconds[2];  // Sum of their lifetimes
+static int epfd;
+static struct timespec push_interval;
+static const char * push_file;
+static unsigned long push_size = 65536;
+static unsigned long push_limit = 4194304;
+static int push_timer = -1;
+static struct timespec push_mtime;
+static shbuffer_t * push_buffer;
+static shbuffer_t * ack_buffer;
+static volatile size_t push_sent;
+static volatile size_t push_bytes;
+static volatile size_t push_dropped;
+static volatile size_t push_slow;
+static size_t push_queued_max;
+static char ** saved_argv;
+static int handoff_fd = -1;
+static struct timespec rate_mark;
+static size_t rate_events;
+static struct timespec rate_prev;
+static size_t rate_prev_events;
+static struct timespec resume_mark;
+static size_t resume_events;
+static double resume_eps;
+static int udp_flag;
+static int udp_gro;
+static int udp_nsocks = 1;
+static udp_worker_t * udp_workers;
+static int udp_started;
+static sockopts_t sockopts;
+static int info_top;
+static int info_timer = -1;
+static pthread_mutex_t info_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char info_report[BUF_SIZE];
+static int * loop_cpus;
+static int nloop_cpus;
+static int monitor_cpu = -1;
+static cpu_set_t cpus_allowed;
+static int * cpu_nodes;
+static int ncpu_nodes;
+static worker_t * workers;
+static int worker_id = -1;
+static worker_t single = { .cpu = -1 };
+static worker_t * self = &single;
+static uint32_t conn_events = EPOLLIN;
+static long sched_quantum;
+static size_t sched_events;
+static size_t sched_budget;     // Events left in the current turn
+static int sched_priority;
+static runqueue_t runqueues[SCHED_CLASSES] = { { -1, -1, 0 }, { -1, -1, 0 } };
+static size_t sched_turns;
+static size_t sched_cut;
+static latency_t service_latency;
+static latency_t conn_latency;
+
+// A sampled connection, for the TCP_INFO report
+typedef struct info_sample_t {
+    int sock;
+    struct tcp_info info;
+} info_sample_t;
 
 static void handler(int signum) {
     debug("%s received (%d)", strsignal(signum), signum);
@@ -28,6 +102,15 @@ static void handler(int signum) {
     case SIGPIPE:
         break;
 
+    case SIGUSR2:
+        restart = 1;
+        break;
+
+    case SIGCHLD:
+        error("A loop exited early: stopping.");
+        running = 0;
+        break;
+
     default:
         error("Unknown signal %d (%s).", signum, strsignal(signum));
     }
@@ -44,6 +127,166 @@ static struct timespec timediff(const struct timespec * ts1, const struct timesp
     return r;
 }
 
+// Parse a CPU list like "0-3,8,10-11". Returns the number of CPUs, or -1 on error.
+
+static int cpulist_parse(const char * list, int ** cpus) {
+    const char * p = list;
+    char * end;
+    long first;
+    long last;
+    int n = 0;
+
+    *cpus = NULL;
+
+    while (*p) {
+        if (first = strtol(p, &end, 10), end == p || first < 0 || first >= CPU_SETSIZE) {
+            free(*cpus);
+            return -1;
+        }
+
+        last = first;
+
+        if (*end == '-' && (p = end + 1, last = strtol(p, &end, 10), end == p || last < first || last >= CPU_SETSIZE)) {
+            free(*cpus);
+            return -1;
+        }
+
+        *cpus = realloc(*cpus, sizeof(int) * (n + last - first + 1));
+
+        while (first <= last) {
+            (*cpus)[n++] = first++;
+        }
+
+        for (p = end; *p == ',' || *p == '\n'; p++);
+    }
+
+    return n;
+}
+
+// Map CPUs to NUMA nodes from sysfs. Without NUMA, every CPU is on node 0.
+
+static void numa_init() {
+    DIR * dir = opendir("/sys/devices/system/node");
+    struct dirent * entry;
+    char path[PATH_MAX];
+    char list[BUF_SIZE];
+    FILE * fp;
+    int * cpus;
+    int node;
+    int n;
+    int i;
+
+    if (!dir) {
+        debug("No NUMA information.");
+        return;
+    }
+
+    while (entry = readdir(dir), entry) {
+        if (sscanf(entry->d_name, "node%d", &node) != 1) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+
+        if (fp = fopen(path, "r"), !fp) {
+            continue;
+        }
+
+        if (fgets(list, sizeof(list), fp) && (n = cpulist_parse(list, &cpus), n > 0)) {
+            for (i = 0; i < n; i++) {
+                if (cpus[i] >= ncpu_nodes) {
+                    cpu_nodes = realloc(cpu_nodes, sizeof(int) * (cpus[i] + 1));
+                    memset(cpu_nodes + ncpu_nodes, 0, sizeof(int) * (cpus[i] + 1 - ncpu_nodes));
+                    ncpu_nodes = cpus[i] + 1;
+                }
+
+                cpu_nodes[cpus[i]] = node;
+            }
+
+            free(cpus);
+        }
+
+        fclose(fp);
+    }
+
+    closedir(dir);
+}
+
+static int cpu_node(int cpu) {
+    return cpu >= 0 && cpu < ncpu_nodes ? cpu_nodes[cpu] : 0;
+}
+
+// Pin the calling thread to a CPU, and allocate its memory on the local node
+
+static int cpu_pin(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        error2("sched_setaffinity(%d)", cpu);
+        return -1;
+    }
+
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0) {
+        warn2("set_mempolicy(MPOL_LOCAL)");
+    }
+
+    debug("Pinned to CPU %d (node %d)", cpu, cpu_node(cpu));
+    return 0;
+}
+
+// Steer packets to the socket of the reuseport group whose loop runs on the receiving CPU.
+// The program compares the CPU with each loop CPU (sockets are in the same order); other CPUs use CPU % n.
+
+static int steer_attach(int sock) {
+    struct sock_filter * code = malloc(sizeof(struct sock_filter) * (2 * nloop_cpus + 3));
+    struct sock_fprog prog = { .len = 2 * nloop_cpus + 3, .filter = code };
+    int i;
+    int retval;
+
+    code[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+    for (i = 0; i < nloop_cpus; i++) {
+        code[1 + i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, loop_cpus[i], nloop_cpus + 1, 0);
+        code[nloop_cpus + 3 + i] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+
+    code[nloop_cpus + 1] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nloop_cpus);
+    code[nloop_cpus + 2] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    if (retval = setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)), retval < 0) {
+        error2("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+    }
+
+    free(code);
+    return retval;
+}
+
+// Find out where the packets of a new connection are received, relative to this loop
+
+static void conn_incoming(int sock) {
+    int cpu;
+    int loop_cpu = self->cpu >= 0 ? self->cpu : sched_getcpu();
+    socklen_t length = sizeof(cpu);
+
+    self->conns++;
+
+    if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) < 0 || cpu < 0) {
+        return;
+    }
+
+    debug("Connection %d: incoming CPU %d (node %d), loop CPU %d (node %d)", sock, cpu, cpu_node(cpu), loop_cpu, cpu_node(loop_cpu));
+
+    if (cpu == loop_cpu) {
+        self->local_cpu++;
+    } else if (cpu_node(cpu) != cpu_node(loop_cpu)) {
+        self->remote_node++;
+        netbuffer.buffers[sock].remote = 1;
+    }
+}
+
 void * monitor(void * args) {
     size_t bytes_old = 0;
     size_t bytes_cur;
@@ -51,6 +294,20 @@ void * monitor(void * args) {
     size_t events_old = 0;
     size_t events_cur;
     size_t events_diff;
+    size_t full_old = 0;
+    size_t full_cur;
+    size_t resumed_old = 0;
+    size_t resumed_cur;
+    size_t pushes_old = 0;
+    size_t pushes_cur;
+    size_t pbytes_old = 0;
+    size_t pbytes_cur;
+    size_t dgrams_old = 0;
+    size_t dgrams_cur;
+    size_t lost_cur;
+    size_t lost;
+    size_t late;
+    int j;
     struct timespec c_old = { 0, 0 };
     struct timespec c_cur;
     struct timespec c_diff;
@@ -66,16 +323,37 @@ void * monitor(void * args) {
     int i_perf;
     int i_throughput;
 
+    // Don't compete with the event loop: run on the given CPU, or anywhere
+
+    if (monitor_cpu >= 0) {
+        cpu_pin(monitor_cpu);
+    } else if (nloop_cpus) {
+        sched_setaffinity(0, sizeof(cpus_allowed), &cpus_allowed);
+    }
+
     clock_gettime(CLOCK_MONOTONIC, &c_cur);
 
     while (1) {
         nanosleep(&watch_interval, NULL);
         clock_gettime(CLOCK_MONOTONIC, &c_cur);
-        bytes_cur = acc_bytes;
+
+        if (workers) {
+            for (bytes_cur = events_cur = full_cur = resumed_cur = 0, j = 0; j < nloop_cpus; j++) {
+                bytes_cur += workers[j].bytes;
+                events_cur += workers[j].events;
+                full_cur += workers[j].tls_full;
+                resumed_cur += workers[j].tls_resumed;
+            }
+        } else {
+            bytes_cur = acc_bytes;
+            events_cur = acc_events;
+            full_cur = tls_full;
+            resumed_cur = tls_resumed;
+        }
+
         bytes_diff = bytes_cur - bytes_old;
         c_diff = timediff(&c_cur, &c_old);
         bps = perf_bps(bytes_diff, c_diff);
-        events_cur = acc_events;
         events_diff = events_cur - events_old;
         eps = perf_eps(events_diff, c_diff);
         p_total = bytes_cur;
@@ -95,6 +373,64 @@ void * monitor(void * args) {
         }
 
         printf("\r\e[2KTotal: %.3f %s. Performance: %.3f %s. Throughput: %.3f %s", p_total, U_TOTAL[i_total], p_perf, U_PERF[i_perf], p_throughput, U_THROUGHPUT[i_throughput]);
+
+        if (tls_flag) {
+            printf(". Handshakes: %.1f full/s, %.1f resumed/s", perf_eps(full_cur - full_old, c_diff), perf_eps(resumed_cur - resumed_old, c_diff));
+            full_old = full_cur;
+            resumed_old = resumed_cur;
+        }
+
+        if (push_timer >= 0) {
+            pushes_cur = push_sent;
+            pbytes_cur = push_bytes;
+            bytes_diff = pbytes_cur - pbytes_old;
+            p_perf = perf_bps(bytes_diff, c_diff);
+
+            for (i_perf = 0; i_perf < 4 && p_perf >= 1000; ++i_perf) {
+                p_perf /= 1000;
+            }
+
+            printf(". Pushes: %.1f/s (%.3f %s), slow readers: %zu, dropped: %zu", perf_eps(pushes_cur - pushes_old, c_diff), p_perf, U_PERF[i_perf], push_slow, push_dropped);
+            pushes_old = pushes_cur;
+            pbytes_old = pbytes_cur;
+        }
+
+        if (udp_flag) {
+            for (dgrams_cur = lost_cur = 0, j = 0; j < udp_nsocks; j++) {
+                dgrams_cur += udp_workers[j].datagrams;
+                late = udp_workers[j].late;
+                lost = udp_workers[j].lost;
+                lost_cur += lost > late ? lost - late : 0;
+            }
+
+            printf(". Datagrams: %.3f K/s, lost: %zu (%.3f%%)", perf_eps((dgrams_cur - dgrams_old) / 1000.0, c_diff), lost_cur, dgrams_cur + lost_cur ? lost_cur * 100.0 / (dgrams_cur + lost_cur) : 0);
+            dgrams_old = dgrams_cur;
+        }
+
+        if (nloop_cpus && !udp_flag) {
+            size_t conns = 0;
+            size_t local_cpu = 0;
+            size_t remote_node = 0;
+            size_t remote_bytes = 0;
+
+            for (j = 0; j < (workers ? nloop_cpus : 1); j++) {
+                worker_t * worker = workers ? workers + j : self;
+
+                conns += worker->conns;
+                local_cpu += worker->local_cpu;
+                remote_node += worker->remote_node;
+                remote_bytes += worker->remote_bytes;
+            }
+
+            printf(". Same CPU: %zu/%zu conns. Cross-node: %zu conns (%.1f%% bytes)", local_cpu, conns, remote_node, bytes_cur ? remote_bytes * 100.0 / bytes_cur : 0);
+        }
+
+        if (info_timer >= 0) {
+            pthread_mutex_lock(&info_mutex);
+            printf("\n%s", info_report);
+            pthread_mutex_unlock(&info_mutex);
+        }
+
         fflush(stdout);
 
         c_old = c_cur;
@@ -106,15 +442,39 @@ void * monitor(void * args) {
 }
 
 void help(const char * argv0, int result) {
-    print("Syntax: %s [ -d ] [ -h ] [ -l <ms> ] [ -p <port> ] [ -v ] [ -w <sec> ]", argv0);
+    print("Syntax: %s [ -b <sec> ] [ -B <file> ] [ -c <cert> ] [ -C <cpus> ] [ -d ] [ -G ] [ -h ] [ -I <n> ] [ -k <key> ] [ -K ] [ -l <ms> ] [ -M <cpu> ] [ -o <opt>[=<n>] ] [ -p <port> ] [ -P ] [ -Q <bytes> ] [ -r <n> ] [ -S <bytes>[:<n>] ] [ -T ] [ -U ] [ -v ] [ -w <sec> ] [ -z <bytes> ]", argv0);
     print("");
+    print("    -b <sec>    Broadcast a message to every agent each <sec> seconds.");
+    print("    -B <file>   Broadcast the contents of <file> (reloaded on change).");
+    print("    -c <cert>   TLS certificate (PEM). Default: self-signed.");
+    print("    -C <cpus>   Run one event loop pinned to each CPU of the list (e.g. 0-3,8), each one");
+    print("                with its own SO_REUSEPORT socket. Connections are steered to the loop");
+    print("                on the CPU that receives their packets.");
     print("    -d          Debug mode.");
+    print("    -G          UDP mode: receive coalesced datagrams (UDP_GRO).");
     print("    -h          This help.");
+    print("    -I <n>      Sample TCP_INFO with the watcher, showing the <n> connections with the highest RTT.");
+    print("    -k <key>    TLS private key (PEM). Default: self-signed.");
+    print("    -K          Enable kernel TLS offload (if available).");
     print("    -l <ms>     Processing latency. Default: 0.");
+    print("    -M <cpu>    Pin the watcher to a CPU.");
+    print("    -o <opt>    Socket option, may be repeated: rcvbuf=<bytes>, sndbuf=<bytes>, busy_poll=<us>,");
+    print("                nodelay, cork, notsent_lowat=<bytes>.");
     print("    -p <port>   Port number.");
+    print("    -P          Scheduler: serve connections before their handshake ahead of bulk data.");
+    print("    -Q <bytes>  Output queue limit per agent (slow readers). Default: 4 MiB.");
+    print("    -r <n>      UDP mode: number of SO_REUSEPORT sockets (one thread each). Default: 1.");
+    print("    -S <bytes>[:<n>]");
+    print("                Fair-share scheduler: each ready connection receives up to <bytes> (and");
+    print("                <n> events, if given) per round. Default: one read per readiness event.");
     print("    -t <ms>     Receiving timeout. Default: infinity.");
+    print("    -T          Accept TLS connections (plaintext is still accepted).");
+    print("    -U          UDP mode (instead of TCP).");
     print("    -v          Verbose mode (show messages).");
     print("    -w <sec>    Enable watcher with interval of <sec> seconds.");
+    print("    -z <bytes>  Broadcast message size, if no file is given. Default: 64 KiB.");
+    print("");
+    print("Send SIGUSR2 to hot-restart: the server executes itself again and hands off every connection.");
     exit(result);
 }
 
@@ -122,17 +482,120 @@ static void options(int argc, char * const argv[]) {
     int c;
     long ms;
     int _port;
+    long bytes;
     double seconds;
+    char * end;
 
-    while (c = getopt(argc, argv, "dhl:p:t:vw:"), c != -1) {
+    while (c = getopt(argc, argv, "b:B:c:C:dGhI:k:Kl:M:o:p:PQ:r:S:t:TUvw:z:"), c != -1) {
         switch (c) {
+        case 'b':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (seconds = atof(optarg), seconds <= 0) {
+                error("Option -%c requires a positive argument.", c);
+                continue;
+            }
+
+            push_interval.tv_sec = seconds;
+            push_interval.tv_nsec = (seconds - (long)seconds) * 1000000000;
+            break;
+
+        case 'B':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            push_file = optarg;
+            break;
+
+        case 'c':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            tls_cert = optarg;
+            break;
+
+        case 'C':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (nloop_cpus = cpulist_parse(optarg, &loop_cpus), nloop_cpus <= 0) {
+                error("Option -%c needs a list of CPUs.", c);
+                nloop_cpus = 0;
+                continue;
+            }
+
+            // The steering program jumps over the whole list with an 8-bit offset
+
+            if (nloop_cpus > STEER_MAX_CPUS) {
+                error("Option -%c accepts at most %d CPUs.", c, STEER_MAX_CPUS);
+                nloop_cpus = 0;
+                continue;
+            }
+
+            break;
+
         case 'd':
             debug_flag = 1;
             break;
 
+        case 'G':
+            udp_gro = 1;
+            break;
+
         case 'h':
             help(argv[0], 0);
 
+        case 'I':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (info_top = atoi(optarg), info_top < 0) {
+                error("Option -%c needs a nonnegative argument.", c);
+                info_top = 0;
+                continue;
+            }
+
+            info_timer = 0;
+            break;
+
+        case 'k':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            tls_key = optarg;
+            break;
+
+        case 'K':
+            ktls_flag = 1;
+            break;
+
+        case 'M':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (monitor_cpu = atoi(optarg), monitor_cpu < 0 || monitor_cpu >= CPU_SETSIZE) {
+                error("Option -%c needs a CPU number.", c);
+                monitor_cpu = -1;
+                continue;
+            }
+
+            break;
+
         case 'l':
             if (!optarg) {
                 error("Option -%c needs an argument.", c);
@@ -148,6 +611,18 @@ static void options(int argc, char * const argv[]) {
             delay.tv_nsec = (ms % 1000) * 1000000;
             break;
 
+        case 'o':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (so_parse(&sockopts, optarg) < 0) {
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+
         case 'p':
             if (!optarg) {
                 error("Option -%c needs an argument.", c);
@@ -162,6 +637,59 @@ static void options(int argc, char * const argv[]) {
             port = (in_port_t)_port;
             break;
 
+        case 'Q':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (bytes = atol(optarg), bytes <= 0) {
+                error("Option -%c needs a positive argument.", c);
+                continue;
+            }
+
+            push_limit = bytes;
+            break;
+
+        case 'P':
+            sched_priority = 1;
+            break;
+
+        case 'r':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (udp_nsocks = atoi(optarg), udp_nsocks <= 0) {
+                error("Option -%c needs a positive argument.", c);
+                udp_nsocks = 1;
+                continue;
+            }
+
+            break;
+
+        case 'S':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (sched_quantum = strtol(optarg, &end, 10), sched_quantum <= 0 || (*end && *end != ':')) {
+                error("Option -%c needs a positive quantum.", c);
+                sched_quantum = 0;
+                continue;
+            }
+
+            if (*end == ':' && (sched_events = strtoul(end + 1, &end, 10), !sched_events || *end)) {
+                error("Option -%c needs a positive number of events.", c);
+                sched_quantum = 0;
+                sched_events = 0;
+                continue;
+            }
+
+            break;
+
         case 't':
             if (!optarg) {
                 error("Option -%c needs an argument.", c);
@@ -177,6 +705,14 @@ static void options(int argc, char * const argv[]) {
             timeout.tv_usec = (ms % 1000) * 1000;
             break;
 
+        case 'T':
+            tls_flag = 1;
+            break;
+
+        case 'U':
+            udp_flag = 1;
+            break;
+
         case 'v':
             verbose_flag = 1;
             break;
@@ -191,107 +727,1700 @@ static void options(int argc, char * const argv[]) {
             watch_interval.tv_nsec = (seconds - (long)seconds) * 1000000000;
             break;
 
+        case 'z':
+            if (!optarg) {
+                error("Option -%c needs an argument.", c);
+                continue;
+            }
+
+            if (bytes = atol(optarg), bytes <= 0 || bytes > UINT32_MAX) {
+                error("Option -%c needs a positive 32-bit argument.", c);
+                continue;
+            }
+
+            push_size = bytes;
+            break;
+
         default:
             help(argv[0], 1);
         }
     }
-}
 
-int dispatch(int sock, char * data, unsigned long size) {
-    uint32_t length;
-    uint32_t * header;
-    long nsend;
-    char buffer[BUF_SIZE + 1];
+    if ((tls_cert != NULL) != (tls_key != NULL)) {
+        error("Options -c and -k must be used together.");
+        exit(EXIT_FAILURE);
+    }
 
-    acc_events++;
+    if (udp_flag && (tls_flag || push_interval.tv_sec || push_interval.tv_nsec || info_timer == 0)) {
+        error("TLS, broadcast and TCP_INFO are not available in UDP mode.");
+        exit(EXIT_FAILURE);
+    }
 
-    if (strncmp(data, HC_STARTUP, strlen(HC_STARTUP)) == 0) {
-        debug("Client %d sent startup.", sock);
+    if (info_timer == 0 && !watch_interval.tv_sec && !watch_interval.tv_nsec) {
+        error("Option -I needs the watcher (-w).");
+        exit(EXIT_FAILURE);
+    }
 
-        length = strlen(HC_ACK);
-        header = (uint32_t *)buffer;
-        *header = length;
-        memcpy(buffer + sizeof(length), HC_ACK, length);
-        length += sizeof(length);
+    if (sched_priority && !sched_quantum) {
+        error("Option -P needs the scheduler (-S).");
+        exit(EXIT_FAILURE);
+    }
 
-        debug("send(\"%s\")", HC_ACK);
-        nsend = send(sock, buffer, length, 0);
+    // The scheduler keeps track of ready connections, so it only needs to hear about new data
 
-        if (nsend != (ssize_t)length) {
-            error2("send(\"HC_ACK\")");
-            return -1;
-        }
-    } else {
-        debug("Received from %d: %.10s (%lu)", sock, data, size);
+    if (sched_quantum) {
+        conn_events |= EPOLLET;
+    }
 
-        if (delay.tv_sec || delay.tv_nsec) {
-            nanosleep(&delay, NULL);
+    if (info_timer == 0 && nloop_cpus > 1 && !udp_flag) {
+        error("Option -I is not available with several event loops.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Generate an ephemeral self-signed certificate and load it into the context
+
+static int tls_selfsigned(SSL_CTX * ctx) {
+    EVP_PKEY * pkey;
+    X509 * x509;
+    X509_NAME * name;
+    int retval = -1;
+
+    debug("EVP_EC_gen(P-256)");
+    if (pkey = EVP_EC_gen("P-256"), !pkey) {
+        error_tls("EVP_EC_gen()");
+        return -1;
+    }
+
+    if (x509 = X509_new(), !x509) {
+        error_tls("X509_new()");
+        EVP_PKEY_free(pkey);
+        return -1;
+    }
+
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 365 * 86400L);
+    X509_set_pubkey(x509, pkey);
+    name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"tcp-handshake", -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+
+    if (!X509_sign(x509, pkey, EVP_sha256())) {
+        error_tls("X509_sign()");
+    } else if (SSL_CTX_use_certificate(ctx, x509) != 1) {
+        error_tls("SSL_CTX_use_certificate()");
+    } else if (SSL_CTX_use_PrivateKey(ctx, pkey) != 1) {
+        error_tls("SSL_CTX_use_PrivateKey()");
+    } else {
+        retval = 0;
+    }
+
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    return retval;
+}
+
+static SSL_CTX * tls_init() {
+    SSL_CTX * ctx;
+
+    if (ctx = SSL_CTX_new(TLS_server_method()), !ctx) {
+        error_tls("SSL_CTX_new()");
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+    // Stateless session tickets; a single ticket per connection is enough for resumption
+
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    // Output queues resume writes at an offset: let SSL_write() behave like send()
+
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if (ktls_flag) {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+
+    if (tls_cert) {
+        debug("Loading certificate '%s' and key '%s'", tls_cert, tls_key);
+
+        if (SSL_CTX_use_certificate_chain_file(ctx, tls_cert) != 1) {
+            error_tls("SSL_CTX_use_certificate_chain_file(%s)", tls_cert);
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+
+        if (SSL_CTX_use_PrivateKey_file(ctx, tls_key, SSL_FILETYPE_PEM) != 1) {
+            error_tls("SSL_CTX_use_PrivateKey_file(%s)", tls_key);
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+    } else if (tls_selfsigned(ctx) < 0) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+// Decide the transport of a new connection by peeking its first byte.
+// Returns 1 if ready to receive data, 0 to wait for more data, or -1 to close.
+
+static int tls_prepare(int sock) {
+    sockbuffer_t * buffer = &netbuffer.buffers[sock];
+    unsigned char byte;
+    int ret;
+
+    if (buffer->transport == TR_PENDING) {
+        switch (recv(sock, &byte, 1, MSG_PEEK)) {
+        case -1:
+            return errno == EAGAIN ? 0 : -1;
+
+        case 0:
+            return -1;
+        }
+
+        if (byte != TLS_RECORD_HANDSHAKE) {
+            buffer->transport = TR_PLAIN;
+            return 1;
+        }
+
+        // Session tickets and HC_ACK are small writes: don't let Nagle delay them
+
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int)) < 0) {
+            error2("setsockopt(%d, TCP_NODELAY)", sock);
+            return -1;
+        }
+
+        if (buffer->ssl = SSL_new(tls_ctx), !buffer->ssl) {
+            error_tls("SSL_new()");
+            return -1;
+        }
+
+        SSL_set_fd(buffer->ssl, sock);
+        SSL_set_accept_state(buffer->ssl);
+        buffer->transport = TR_TLS;
+        ++tls_conns;
+    }
+
+    if (buffer->transport == TR_PLAIN || SSL_is_init_finished(buffer->ssl)) {
+        return 1;
+    }
+
+    ERR_clear_error();
+
+    if (ret = SSL_do_handshake(buffer->ssl), ret != 1) {
+        switch (SSL_get_error(buffer->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return 0;
+
+        default:
+            warn_tls("SSL_do_handshake(%d)", sock);
+            return -1;
+        }
+    }
+
+    if (SSL_session_reused(buffer->ssl)) {
+        ++tls_resumed;
+    } else {
+        ++tls_full;
+    }
+
+    if (BIO_get_ktls_send(SSL_get_wbio(buffer->ssl)) || BIO_get_ktls_recv(SSL_get_rbio(buffer->ssl))) {
+        ++tls_ktls;
+    }
+
+    debug("TLS handshake with %d: %s, %s (%s)", sock, SSL_get_version(buffer->ssl), SSL_get_cipher(buffer->ssl), SSL_session_reused(buffer->ssl) ? "resumed" : "full");
+    return 1;
+}
+
+// Read from a TLS connection with recv() semantics: -1 and errno EAGAIN if no data is available yet
+
+static long tls_recv(SSL * ssl, void * buf, int len) {
+    int ret;
+
+    ERR_clear_error();
+
+    if (ret = SSL_read(ssl, buf, len), ret > 0) {
+        return ret;
+    }
+
+    switch (SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+
+    case SSL_ERROR_SYSCALL:
+        return errno ? -1 : 0;
+
+    default:
+        warn_tls("SSL_read()");
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+// Write to a TLS connection with send() semantics
+
+static long tls_send(SSL * ssl, const void * buf, unsigned long len) {
+    int ret;
+
+    ERR_clear_error();
+
+    if (ret = SSL_write(ssl, buf, len > INT_MAX ? INT_MAX : len), ret > 0) {
+        return ret;
+    }
+
+    switch (SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+
+    case SSL_ERROR_SYSCALL:
+        return -1;
+
+    default:
+        warn_tls("SSL_write()");
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+static shbuffer_t * sb_new(char * data, unsigned long size, int fd) {
+    shbuffer_t * shared = malloc(sizeof(shbuffer_t));
+
+    shared->refs = 1;
+    shared->header = size;
+    shared->data = data;
+    shared->size = size;
+    shared->fd = fd;
+    return shared;
+}
+
+static void sb_release(shbuffer_t * shared) {
+    if (--shared->refs) {
+        return;
+    }
+
+    if (shared->fd >= 0) {
+        if (shared->size) {
+            munmap(shared->data, shared->size);
+        }
+
+        close(shared->fd);
+    } else {
+        free(shared->data);
+    }
+
+    free(shared);
+}
+
+// Copy the broadcast file into a sealed memory file, and map it. Queued messages keep their contents
+// even if the file is edited in place, and the pages are still shared by every connection.
+
+static shbuffer_t * push_load() {
+    struct stat st;
+    char * data = NULL;
+    off_t size = 0;
+    long ncopy = 0;
+    int file;
+    int fd;
+
+    if (file = open(push_file, O_RDONLY), file < 0) {
+        error2("open(%s)", push_file);
+        return NULL;
+    }
+
+    if (fstat(file, &st) < 0) {
+        error2("fstat(%s)", push_file);
+        close(file);
+        return NULL;
+    }
+
+    if (st.st_size > UINT32_MAX) {
+        error("File '%s' is too large to be sent.", push_file);
+        close(file);
+        return NULL;
+    }
+
+    if (fd = memfd_create("push", MFD_CLOEXEC | MFD_ALLOW_SEALING), fd < 0) {
+        error2("memfd_create()");
+        close(file);
+        return NULL;
+    }
+
+    // The file may shrink while it is copied: the message is what could be read
+
+    while (size < st.st_size && (ncopy = sendfile(fd, file, &size, st.st_size - size), ncopy > 0));
+    close(file);
+
+    if (ncopy < 0) {
+        error2("sendfile(%s)", push_file);
+        close(fd);
+        return NULL;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        error2("fcntl(F_ADD_SEALS)");
+        close(fd);
+        return NULL;
+    }
+
+    if (size && (data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0), data == MAP_FAILED)) {
+        error2("mmap(%s)", push_file);
+        close(fd);
+        return NULL;
+    }
+
+    push_mtime = st.st_mtim;
+    debug("Loaded '%s' (%ld bytes)", push_file, (long)size);
+    return sb_new(data, size, fd);
+}
+
+static shbuffer_t * push_generate() {
+    char * data = malloc(push_size);
+    unsigned long i;
+
+    for (i = 0; i < push_size; i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    memcpy(data, "PUSH", push_size < 4 ? push_size : 4);
+    return sb_new(data, push_size, -1);
+}
+
+// Queue the current message to every handshaked agent
+
+static void broadcast() {
+    struct stat st;
+    sockbuffer_t * buffer;
+    shbuffer_t * shared;
+    int sock;
+    size_t slow = 0;
+
+    if (push_file && stat(push_file, &st) == 0 && (st.st_mtim.tv_sec != push_mtime.tv_sec || st.st_mtim.tv_nsec != push_mtime.tv_nsec)) {
+        if (shared = push_load(), shared) {
+            verbose("File '%s' changed, broadcasting new version.", push_file);
+            sb_release(push_buffer);
+            push_buffer = shared;
+        }
+    }
+
+    for (sock = 0; netbuffer.buffers && sock <= netbuffer.max_fd; sock++) {
+        buffer = &netbuffer.buffers[sock];
+
+        if (!buffer->open || !buffer->handshaked) {
+            continue;
+        }
+
+        // The agent did not consume the previous message yet
+
+        if (buffer->out_head) {
+            ++slow;
+        }
+
+        if (buffer->out_len + sizeof(uint32_t) + push_buffer->size > push_limit) {
+            debug("Output queue of %d is full (%lu bytes).", sock, buffer->out_len);
+            ++push_dropped;
+            continue;
+        }
+
+        if (nb_send(buffer, sock, push_buffer) < 0) {
+            verbose("Socket %d closed while pushing (%d).", sock, nconn);
+            nb_close(&netbuffer, sock);
+        }
+    }
+
+    push_slow = slow;
+}
+
+// Run queues, linked through the socket buffers
+
+static void rq_push(int sock) {
+    sockbuffer_t * buffer = &netbuffer.buffers[sock];
+    int class = sched_priority && !buffer->handshaked ? 0 : 1;
+    runqueue_t * queue = runqueues + class;
+
+    buffer->queued = class + 1;
+    buffer->prev = queue->tail;
+    buffer->next = -1;
+
+    if (queue->tail >= 0) {
+        netbuffer.buffers[queue->tail].next = sock;
+    } else {
+        queue->head = sock;
+    }
+
+    queue->tail = sock;
+    queue->len++;
+}
+
+static void rq_remove(int sock) {
+    sockbuffer_t * buffer = &netbuffer.buffers[sock];
+    runqueue_t * queue = runqueues + buffer->queued - 1;
+
+    if (buffer->prev >= 0) {
+        netbuffer.buffers[buffer->prev].next = buffer->next;
+    } else {
+        queue->head = buffer->next;
+    }
+
+    if (buffer->next >= 0) {
+        netbuffer.buffers[buffer->next].prev = buffer->prev;
+    } else {
+        queue->tail = buffer->prev;
+    }
+
+    buffer->queued = 0;
+    queue->len--;
+}
+
+// Blocking I/O on the handoff socket
+
+static int handoff_write(const void * buf, size_t len) {
+    ssize_t nsend;
+
+    for (; len > 0; buf = (const char *)buf + nsend, len -= nsend) {
+        if (nsend = send(handoff_fd, buf, len, MSG_NOSIGNAL), nsend < 0) {
+            if (errno == EINTR) {
+                nsend = 0;
+                continue;
+            }
+
+            error2("send(handoff)");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int handoff_read(void * buf, size_t len) {
+    ssize_t nrecv;
+
+    for (; len > 0; buf = (char *)buf + nrecv, len -= nrecv) {
+        if (nrecv = recv(handoff_fd, buf, len, 0), nrecv <= 0) {
+            if (nrecv < 0 && errno == EINTR) {
+                nrecv = 0;
+                continue;
+            }
+
+            error2("recv(handoff)");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Send data with a batch of file descriptors attached
+
+static int handoff_sendfds(const void * buf, size_t len, const int * fds, int nfds) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)] = { 0 };
+    struct iovec iov = { (void *)buf, len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(sizeof(int) * nfds) };
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+    if (sendmsg(handoff_fd, &msg, MSG_NOSIGNAL) != (ssize_t)len) {
+        error2("sendmsg(handoff)");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Receive exactly len bytes, and the file descriptors attached to them. Returns the number of descriptors, or -1.
+
+static int handoff_recvfds(void * buf, size_t len, int * fds) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    struct iovec iov = { buf, len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr * cmsg;
+    ssize_t nrecv;
+    int nfds = 0;
+
+    if (nrecv = recvmsg(handoff_fd, &msg, MSG_WAITALL), nrecv <= 0) {
+        error2("recvmsg(handoff)");
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+        }
+    }
+
+    return (size_t)nrecv < len && handoff_read((char *)buf + nrecv, len - nrecv) < 0 ? -1 : nfds;
+}
+
+// Start the new server process. The old one keeps serving until the new one is ready.
+
+static void handoff_start() {
+    int fds[2];
+    pid_t pid;
+
+    if (handoff_fd >= 0) {
+        warn("Hot restart already in progress.");
+        return;
+    }
+
+    if (workers) {
+        warn("Hot restart is not available with several event loops.");
+        return;
+    }
+
+    info("Hot restart: starting '%s'.", saved_argv[0]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        error2("socketpair()");
+        return;
+    }
+
+    switch (pid = fork(), pid) {
+    case -1:
+        error2("fork()");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+
+    case 0:
+        // Inherit only the standard streams and the handoff socket
+
+        if (dup2(fds[1], 3) < 0) {
+            error2("dup2()");
+            _exit(EXIT_FAILURE);
+        }
+
+        close_range(4, ~0U, 0);
+        setenv(HANDOFF_ENV, "3", 1);
+        execvp(saved_argv[0], saved_argv);
+        error2("execvp(%s)", saved_argv[0]);
+        _exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event request = { .events = EPOLLIN, .data = { .fd = fds[0] } };
+
+    close(fds[1]);
+    handoff_fd = fds[0];
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, handoff_fd, &request) < 0) {
+        error2("epoll_ctl(handoff)");
+        close(handoff_fd);
+        handoff_fd = -1;
+    }
+}
+
+// Send a batch of connections: descriptors, state, and pending data
+
+static int handoff_batch(const handoff_conn_t * conns, const int * fds, int nfds) {
+    uint32_t count = nfds;
+    sockbuffer_t * buffer;
+    outqueue_t * node;
+    unsigned long offset;
+    int i;
+
+    if (handoff_sendfds(&count, sizeof(count), fds, nfds) < 0 || handoff_write(conns, sizeof(handoff_conn_t) * nfds) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < nfds; i++) {
+        buffer = &netbuffer.buffers[fds[i]];
+
+        if (handoff_write(buffer->data, buffer->data_len) < 0) {
+            return -1;
+        }
+
+        // Flatten the output queue: what remains of each message
+
+        for (node = buffer->out_head; node; node = node->next) {
+            if (node->offset < sizeof(uint32_t) && handoff_write((char *)&node->buffer->header + node->offset, sizeof(uint32_t) - node->offset) < 0) {
+                return -1;
+            }
+
+            offset = node->offset > sizeof(uint32_t) ? node->offset - sizeof(uint32_t) : 0;
+
+            if (handoff_write(node->buffer->data + offset, node->buffer->size - offset) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// The new server is ready: pass the listening socket and every connection to it.
+// Returns 0 if the handoff succeeded and this process must exit.
+
+// Whether a slot of the table is a connection to hand off: never the listening socket, epoll or the timers
+
+static int handoff_conn(int fd, int sock) {
+    return netbuffer.buffers[fd].open && fd != sock && fd != epfd && fd != handoff_fd && fd != push_timer && fd != info_timer;
+}
+
+static int handoff_send(int sock) {
+    handoff_header_t header = { .acc_bytes = acc_bytes, .acc_events = acc_events, .push_sent = push_sent, .push_bytes = push_bytes, .c_begin = c_begin };
+    handoff_conn_t conns[HANDOFF_BATCH];
+    int fds[HANDOFF_BATCH];
+    int nfds = 0;
+    int fd;
+    char ready;
+    sockbuffer_t * buffer;
+    struct timespec c_diff;
+
+    if (recv(handoff_fd, &ready, 1, 0) != 1) {
+        error("Hot restart: the new server failed to start.");
+        goto fail;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &header.c_stop);
+
+    // The rate of the last full second, if the server has run for one (otherwise 0: no comparison)
+
+    if (rate_prev.tv_sec) {
+        c_diff = timediff(&header.c_stop, &rate_prev);
+        header.eps = perf_eps((double)(acc_events - rate_prev_events), c_diff);
+    }
+
+    // TLS state lives in this process: those agents will have to reconnect
+
+    for (fd = 0; netbuffer.buffers && fd <= netbuffer.max_fd; fd++) {
+        if (handoff_conn(fd, sock) && netbuffer.buffers[fd].transport == TR_TLS) {
+            verbose("Closing TLS connection %d before handoff.", fd);
+            nb_close(&netbuffer, fd);
+        }
+    }
+
+    for (fd = 0; netbuffer.buffers && fd <= netbuffer.max_fd; fd++) {
+        header.nconn += handoff_conn(fd, sock);
+    }
+
+    if (handoff_sendfds(&header, sizeof(header), &sock, 1) < 0) {
+        goto fail;
+    }
+
+    for (fd = 0; netbuffer.buffers && fd <= netbuffer.max_fd; fd++) {
+        buffer = &netbuffer.buffers[fd];
+
+        if (!handoff_conn(fd, sock)) {
+            continue;
+        }
+
+        conns[nfds].transport = buffer->transport;
+        conns[nfds].handshaked = buffer->handshaked;
+        conns[nfds].data_len = buffer->data_len;
+        conns[nfds].out_len = buffer->out_len;
+        fds[nfds++] = fd;
+
+        if (nfds == HANDOFF_BATCH) {
+            if (handoff_batch(conns, fds, nfds) < 0) {
+                goto fail;
+            }
+
+            nfds = 0;
+        }
+    }
+
+    if (nfds > 0 && handoff_batch(conns, fds, nfds) < 0) {
+        goto fail;
+    }
+
+    // Wait until the new server owns every connection
+
+    if (recv(handoff_fd, &ready, 1, 0) != 1) {
+        error("Hot restart: the new server did not confirm the handoff.");
+        goto fail;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &c_diff);
+    c_diff = timediff(&c_diff, &header.c_stop);
+    info("Hot restart: %u connections handed off in %f ms. Exiting.", header.nconn, c_diff.tv_sec * 1000 + c_diff.tv_nsec / 1000000.0);
+    return 0;
+
+fail:
+    error("Hot restart aborted.");
+    close(handoff_fd);
+    handoff_fd = -1;
+    return -1;
+}
+
+// Take over the listening socket and the connections from the old server. Returns the listening socket.
+
+static int handoff_receive() {
+    handoff_header_t header;
+    handoff_conn_t conns[HANDOFF_BATCH];
+    int fds[HANDOFF_BATCH];
+    uint32_t count;
+    uint32_t received;
+    uint32_t i;
+    int sock;
+    sockbuffer_t * buffer;
+    outqueue_t * node;
+    struct epoll_event request = { .events = conn_events };
+    struct timespec c_diff;
+
+    debug("Hot restart: ready to take over.");
+
+    if (handoff_write("R", 1) < 0) {
+        return -1;
+    }
+
+    if (handoff_recvfds(&header, sizeof(header), &sock) != 1) {
+        error("Hot restart: listening socket not received.");
+        return -1;
+    }
+
+    for (received = 0; received < header.nconn; received += count) {
+        if (handoff_recvfds(&count, sizeof(count), fds) != (int)count || count > HANDOFF_BATCH || handoff_read(conns, sizeof(handoff_conn_t) * count) < 0) {
+            error("Hot restart: bad connection batch.");
+            return -1;
+        }
+
+        for (i = 0; i < count; i++) {
+            nb_open(&netbuffer, fds[i]);
+            buffer = &netbuffer.buffers[fds[i]];
+            buffer->transport = conns[i].transport;
+            buffer->handshaked = conns[i].handshaked;
+            buffer->data_size = conns[i].data_len + BUF_SIZE;
+            buffer->data = malloc(buffer->data_size);
+            buffer->data_len = conns[i].data_len;
+
+            if (handoff_read(buffer->data, buffer->data_len) < 0) {
+                return -1;
+            }
+
+            // Pending output becomes a private message whose header was already sent
+
+            if (conns[i].out_len) {
+                node = malloc(sizeof(outqueue_t));
+                node->buffer = sb_new(malloc(conns[i].out_len), conns[i].out_len, -1);
+                node->offset = sizeof(uint32_t);
+                node->next = NULL;
+                buffer->out_head = buffer->out_tail = node;
+                buffer->out_len = conns[i].out_len;
+
+                if (handoff_read(node->buffer->data, conns[i].out_len) < 0) {
+                    return -1;
+                }
+            }
+
+            request.data.fd = fds[i];
+
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &request) < 0) {
+                error2("epoll_ctl() [5]");
+                nb_close(&netbuffer, fds[i]);
+                continue;
+            }
+
+            if (buffer->out_head && nb_flush(buffer, fds[i]) < 0) {
+                nb_close(&netbuffer, fds[i]);
+                continue;
+            }
+
+            // Messages held back by the event quota: edge-triggered epoll will not report them again
+
+            if (sched_quantum && buffer->data_len >= sizeof(uint32_t) && sizeof(uint32_t) + *(uint32_t *)buffer->data <= buffer->data_len) {
+                buffer->ready = now_ns();
+                rq_push(fds[i]);
+            }
+        }
+    }
+
+    acc_bytes = header.acc_bytes;
+    acc_events = header.acc_events;
+    push_sent = header.push_sent;
+    push_bytes = header.push_bytes;
+    c_begin = header.c_begin;
+
+    if (handoff_write("D", 1) < 0) {
+        return -1;
+    }
+
+    close(handoff_fd);
+    handoff_fd = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &resume_mark);
+    resume_events = acc_events;
+    resume_eps = header.eps;
+    c_diff = timediff(&resume_mark, &header.c_stop);
+    info("Hot restart: took over %u connections. Ingest gap: %f ms.", header.nconn, c_diff.tv_sec * 1000 + c_diff.tv_nsec / 1000000.0);
+
+    // The old server did not run for a full second: there is no rate to compare with
+
+    if (!resume_eps) {
+        resume_mark.tv_sec = 0;
+    }
+    return sock;
+}
+
+// Find or insert a sender in the worker's table
+
+static udp_sender_t * udp_sender(udp_worker_t * worker, uint32_t agent) {
+    udp_sender_t * old = worker->senders;
+    unsigned long old_size = worker->senders_size;
+    unsigned long i;
+
+    // Keep the load factor under 1/2
+
+    if (worker->nsenders * 2 >= worker->senders_size) {
+        worker->senders_size = old_size ? old_size * 2 : 1024;
+        worker->senders = calloc(worker->senders_size, sizeof(udp_sender_t));
+        worker->nsenders = 0;
+
+        for (i = 0; i < old_size; i++) {
+            if (old[i].used) {
+                *udp_sender(worker, old[i].agent) = old[i];
+            }
+        }
+
+        free(old);
+    }
+
+    for (i = (agent * 2654435761U) & (worker->senders_size - 1); worker->senders[i].used; i = (i + 1) & (worker->senders_size - 1)) {
+        if (worker->senders[i].agent == agent) {
+            return &worker->senders[i];
+        }
+    }
+
+    worker->senders[i].used = 1;
+    worker->senders[i].agent = agent;
+    worker->nsenders++;
+    return &worker->senders[i];
+}
+
+// Account a datagram and dispatch its messages. Returns the number of messages.
+
+static size_t udp_datagram(udp_worker_t * worker, char * data, unsigned long size) {
+    udp_header_t * header = (udp_header_t *)data;
+    udp_sender_t * sender;
+    unsigned long i;
+    uint32_t length;
+    uint32_t offset;
+    size_t nevents = 0;
+
+    if (size < sizeof(udp_header_t)) {
+        debug("Datagram too short (%lu bytes)", size);
+        return 0;
+    }
+
+    sender = udp_sender(worker, header->agent);
+
+    // Serial number arithmetic: the sequence wraps. Only a datagram counted in a gap makes up for a loss.
+
+    if ((int32_t)(header->seq - sender->next) >= 0) {
+        offset = header->seq - sender->next + 1;
+        worker->lost += offset - 1;
+        sender->seen = (offset < 64 ? sender->seen << offset : 0) | 1;
+        sender->next = header->seq + 1;
+    } else {
+        offset = sender->next - 1 - header->seq;
+
+        if (offset >= 64) {
+            debug("Datagram %u from agent %u is too late to be told from a duplicate", header->seq, header->agent);
+        } else if (sender->seen & (uint64_t)1 << offset) {
+            worker->dups++;
+        } else {
+            sender->seen |= (uint64_t)1 << offset;
+            worker->late++;
+        }
+    }
+
+    worker->datagrams++;
+
+    for (i = sizeof(udp_header_t); i + sizeof(uint32_t) <= size; i += sizeof(uint32_t) + length) {
+        length = *(uint32_t *)(data + i);
+
+        if (i + sizeof(uint32_t) + length > size) {
+            debug("Truncated message from agent %u", header->agent);
+            break;
+        }
+
+        debug("Received from agent %u: %.10s (%u)", header->agent, data + i + sizeof(uint32_t), length);
+        nevents++;
+
+        if (delay.tv_sec || delay.tv_nsec) {
+            nanosleep(&delay, NULL);
+        }
+    }
+
+    return nevents;
+}
+
+void * udp_worker(void * args) {
+    udp_worker_t * worker = args;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    char (* controls)[CMSG_SPACE(sizeof(int))] = calloc(UDP_BATCH, CMSG_SPACE(sizeof(int)));
+    char * buffers = malloc((size_t)UDP_BATCH * (UDP_MAX + 1));
+    struct pollfd pfd = { .fd = worker->sock, .events = POLLIN };
+    struct cmsghdr * cmsg;
+    unsigned long size;
+    unsigned long segment;
+    unsigned long offset;
+    size_t bytes;
+    size_t nevents;
+    int nrecv;
+    int i;
+
+    if (worker->cpu >= 0) {
+        cpu_pin(worker->cpu);
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (i = 0; i < UDP_BATCH; i++) {
+        iovs[i].iov_base = buffers + (size_t)i * (UDP_MAX + 1);
+        iovs[i].iov_len = UDP_MAX + 1;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i];
+    }
+
+    while (running) {
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+
+        for (i = 0; i < UDP_BATCH; i++) {
+            msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+        }
+
+        if (nrecv = recvmmsg(worker->sock, msgs, UDP_BATCH, MSG_DONTWAIT, NULL), nrecv < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                error2("recvmmsg()");
+            }
+
+            continue;
+        }
+
+        if (!__atomic_exchange_n(&udp_started, 1, __ATOMIC_RELAXED)) {
+            clock_gettime(CLOCK_MONOTONIC, &c_begin);
+        }
+
+        for (bytes = nevents = 0, i = 0; i < nrecv; i++) {
+            size = segment = msgs[i].msg_len;
+            bytes += size;
+
+            // With GRO, a buffer holds several datagrams of the same size (but the last one)
+
+            for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    segment = *(int *)CMSG_DATA(cmsg);
+                }
+            }
+
+            for (offset = 0; offset < size; offset += segment) {
+                nevents += udp_datagram(worker, (char *)iovs[i].iov_base + offset, size - offset < segment ? size - offset : segment);
+            }
+        }
+
+        __atomic_fetch_add(&acc_bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&acc_events, nevents, __ATOMIC_RELAXED);
+    }
+
+    free(buffers);
+    free(controls);
+    return NULL;
+}
+
+// Read TCP_INFO from every connection and compose the report that the watcher prints
+
+static void tcp_sample() {
+    static info_sample_t * worst;
+    info_sample_t sample;
+    socklen_t length;
+    unsigned long n = 0;
+    unsigned long rtt_sum = 0;
+    unsigned long rtt_max = 0;
+    unsigned long cwnd_sum = 0;
+    unsigned long cwnd_min = ULONG_MAX;
+    unsigned long rcv_space_sum = 0;
+    unsigned long retrans = 0;
+    unsigned long unacked = 0;
+    char report[BUF_SIZE];
+    int len;
+    int nworst = 0;
+    int i;
+
+    if (!worst) {
+        worst = malloc(sizeof(info_sample_t) * (info_top + 1));
+    }
+
+    for (sample.sock = 0; netbuffer.buffers && sample.sock <= netbuffer.max_fd; sample.sock++) {
+        if (!netbuffer.buffers[sample.sock].open) {
+            continue;
+        }
+
+        length = sizeof(sample.info);
+
+        if (getsockopt(sample.sock, IPPROTO_TCP, TCP_INFO, &sample.info, &length) < 0) {
+            warn2("getsockopt(%d, TCP_INFO)", sample.sock);
+            continue;
+        }
+
+        n++;
+        rtt_sum += sample.info.tcpi_rtt;
+        rtt_max = sample.info.tcpi_rtt > rtt_max ? sample.info.tcpi_rtt : rtt_max;
+        cwnd_sum += sample.info.tcpi_snd_cwnd;
+        cwnd_min = sample.info.tcpi_snd_cwnd < cwnd_min ? sample.info.tcpi_snd_cwnd : cwnd_min;
+        rcv_space_sum += sample.info.tcpi_rcv_space;
+        retrans += sample.info.tcpi_total_retrans;
+        unacked += sample.info.tcpi_unacked;
+
+        // Insertion into the top list, sorted by RTT
+
+        for (i = nworst; i > 0 && worst[i - 1].info.tcpi_rtt < sample.info.tcpi_rtt; i--) {
+            worst[i] = worst[i - 1];
+        }
+
+        if (i < info_top) {
+            worst[i] = sample;
+            nworst += nworst < info_top;
+        }
+    }
+
+    if (!n) {
+        len = snprintf(report, sizeof(report), "TCP_INFO: no connections.\n");
+    } else {
+        len = snprintf(report, sizeof(report), "TCP_INFO: %lu connections. RTT: %.3f ms avg, %.3f ms max. Cwnd: %lu avg, %lu min. Rcv space: %lu avg. Retransmits: %lu. Unacked: %lu.\n", n, rtt_sum / 1000.0 / n, rtt_max / 1000.0, cwnd_sum / n, cwnd_min, rcv_space_sum / n, retrans, unacked);
+    }
+
+    for (i = 0; i < nworst && len < (int)sizeof(report); i++) {
+        len += snprintf(report + len, sizeof(report) - len, "  %d: RTT %.3f ms (var %.3f), cwnd %u, retransmits %u, rcv space %u, unacked %u\n", worst[i].sock, worst[i].info.tcpi_rtt / 1000.0, worst[i].info.tcpi_rttvar / 1000.0, worst[i].info.tcpi_snd_cwnd, worst[i].info.tcpi_total_retrans, worst[i].info.tcpi_rcv_space, worst[i].info.tcpi_unacked);
+    }
+
+    pthread_mutex_lock(&info_mutex);
+    memcpy(info_report, report, sizeof(report));
+    pthread_mutex_unlock(&info_mutex);
+}
+
+// Add the data of a connection to the plaintext or TLS totals, once it is closed (or at the end)
+
+static void bulk_account(sockbuffer_t * buffer) {
+    int tls = buffer->transport == TR_TLS;
+
+    if (buffer->bulk_bytes) {
+        bulk_conns[tls]++;
+        bulk_bytes[tls] += buffer->bulk_bytes;
+        bulk_seconds[tls] += (now_ns() - buffer->opened) / 1000000000.0;
+        buffer->bulk_bytes = 0;
+    }
+}
+
+int dispatch(int sock, char * data, unsigned long size) {
+    sockbuffer_t * buffer = &netbuffer.buffers[sock];
+
+    acc_events++;
+
+    if (buffer->ssl) {
+        tls_events++;
+    }
+
+    if (strncmp(data, HC_STARTUP, strlen(HC_STARTUP)) == 0) {
+        debug("Client %d sent startup.", sock);
+
+        // Queued, so that it cannot be interleaved with a broadcast in progress
+
+        debug("send(\"%s\")", HC_ACK);
+        buffer->handshaked = 1;
+
+        if (nb_send(buffer, sock, ack_buffer) < 0) {
+            error2("send(\"HC_ACK\")");
+            return -1;
+        }
+    } else {
+        debug("Received from %d: %.10s (%lu)", sock, data, size);
+        buffer->bulk_bytes += sizeof(uint32_t) + size;
+
+        if (delay.tv_sec || delay.tv_nsec) {
+            nanosleep(&delay, NULL);
+        }
+    }
+
+    // Out of events for this turn: the next messages stay buffered
+
+    if (sched_events && --sched_budget == 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void latency_report(const char * title, const latency_t * hist) {
+    info("%s: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us (%zu samples).", title, latency_quantile(hist, 0.5), latency_quantile(hist, 0.9), latency_quantile(hist, 0.99), latency_quantile(hist, 0.999), hist->max / 1000.0, hist->total);
+}
+
+// Receive from a ready connection: once, or until its quota is spent with the scheduler.
+// Returns -1 if the connection was closed, 0 if it has no more data, or 1 if data may remain.
+
+static int conn_service(int sock) {
+    sockbuffer_t * buffer = &netbuffer.buffers[sock];
+    size_t bytes = acc_bytes;
+    uint64_t latency = now_ns() - buffer->ready;
+    long quota;
+    long nrecv;
+
+    latency_add(&service_latency, latency);
+
+    if (latency > buffer->latency_max) {
+        buffer->latency_max = latency;
+    }
+
+    if (buffer->transport != TR_PLAIN) {
+        switch (tls_prepare(sock)) {
+        case -1:
+            nb_close(&netbuffer, sock);
+            return -1;
+
+        case 0:
+            return 0;
+        }
+    }
+
+    // Messages held back by the event quota go first
+
+    sched_budget = sched_events;
+    nrecv = sched_events && buffer->data_len ? nb_frame(buffer, sock, dispatch) : 0;
+
+    // SSL may hold decrypted data that epoll cannot see, so drain it. Reads never go past the byte quota.
+
+    if (nrecv == 0) {
+        do {
+            quota = sched_quantum ? buffer->deficit - (long)(acc_bytes - bytes) : BUF_SIZE;
+            nrecv = nb_recv(buffer, sock, quota < BUF_SIZE ? quota : BUF_SIZE, dispatch);
+        } while (nrecv > 0 && (sched_quantum ? buffer->deficit > (long)(acc_bytes - bytes) && (!sched_events || sched_budget) : buffer->ssl && SSL_has_pending(buffer->ssl)));
+    }
+
+    buffer->deficit -= acc_bytes - bytes;
+
+    switch (nrecv) {
+    case -1:
+        switch (errno) {
+        case EAGAIN:
+            return 0;
+
+        case ECONNRESET:
+            verbose("Socket %d closed (%d).", sock, nconn);
+            break;
+
+        default:
+            error2("recv(%d)", sock);
+        }
+
+        nb_close(&netbuffer, sock);
+        return -1;
+
+    case 0:
+        nb_close(&netbuffer, sock);
+        return -1;
+    }
+
+    return 1;
+}
+
+// One round of deficit round-robin. The priority class goes first, then every connection
+// that was ready when its class started gets a quantum. Backlogged ones go back to the tail.
+
+static void sched_round() {
+    runqueue_t * queue;
+    sockbuffer_t * buffer;
+    unsigned long n;
+    int class;
+    int sock;
+
+    for (class = 0; class < SCHED_CLASSES; class++) {
+        queue = runqueues + class;
+
+        for (n = queue->len; n > 0 && queue->head >= 0; n--) {
+            sock = queue->head;
+            buffer = &netbuffer.buffers[sock];
+            rq_remove(sock);
+            buffer->deficit += sched_quantum;
+
+            // Still in debt from an earlier turn: wait for the next round without reading
+
+            if (buffer->deficit <= 0) {
+                rq_push(sock);
+                continue;
+            }
+
+            sched_turns++;
+
+            switch (conn_service(sock)) {
+            case 0:
+                // An idle connection does not keep its credit
+                buffer->deficit = 0;
+                break;
+
+            case 1:
+                sched_cut++;
+                buffer->ready = now_ns();
+                rq_push(sock);
+            }
+        }
+    }
+}
+
+static void summary(const struct timespec * c_end) {
+    struct timespec c_diff;
+    int i;
+
+    info("Data received: %zu events, %zu MB", acc_events, acc_bytes / 1000000);
+
+    if (c_begin.tv_sec) {
+        c_diff = timediff(c_end, &c_begin);
+        info("Time: %f sec.", (c_diff.tv_sec + (double)c_diff.tv_nsec / 1000000000));
+        info("Performance: %f Mbps.", perf_bps(acc_bytes, c_diff) / 1000000);
+        info("Throughput: %f Keps.", perf_eps(acc_events / 1000, c_diff));
+
+        if (nloop_cpus && !udp_flag) {
+            worker_t total = { .conns = 0 };
+            int nworkers = workers && worker_id < 0 ? nloop_cpus : 1;
+
+            for (i = 0; i < nworkers; i++) {
+                worker_t * worker = nworkers > 1 ? workers + i : self;
+
+                if (nworkers > 1) {
+                    info("Loop %d (CPU %d, node %d): %zu events, %zu MB, %zu connections.", i, worker->cpu, worker->node, worker->events, worker->bytes / 1000000, worker->conns);
+                }
+
+                total.conns += worker->conns;
+                total.local_cpu += worker->local_cpu;
+                total.remote_node += worker->remote_node;
+                total.remote_bytes += worker->remote_bytes;
+            }
+
+            info("Connections: %zu, %zu received on the loop CPU, %zu from another NUMA node (%f MB).", total.conns, total.local_cpu, total.remote_node, total.remote_bytes / 1000000.0);
+        }
+
+        if (tls_flag && !(workers && worker_id < 0)) {
+            info("TLS handshakes: %zu full, %zu resumed, %zu with kTLS.", tls_full, tls_resumed, tls_ktls);
+            info("TLS data: %zu events, %zu MB over %zu connections.", tls_events, tls_bytes / 1000000, tls_conns);
+
+            // Per-connection bulk throughput, plaintext vs TLS, when both kinds of clients were run.
+            // Only connections that sent data count, for as long as they were open.
+
+            for (i = 0; netbuffer.buffers && i <= netbuffer.max_fd; i++) {
+                if (netbuffer.buffers[i].open) {
+                    bulk_account(&netbuffer.buffers[i]);
+                }
+            }
+
+            if (bulk_seconds[0] > 0 && bulk_seconds[1] > 0) {
+                double plain_rate = bulk_bytes[0] * 8 / bulk_seconds[0];
+                double tls_rate = bulk_bytes[1] * 8 / bulk_seconds[1];
+
+                info("Per-connection performance: %f Mbps plaintext (%zu connections), %f Mbps TLS (%zu connections) (penalty: %.2f%%).", plain_rate / 1000000, bulk_conns[0], tls_rate / 1000000, bulk_conns[1], (1 - tls_rate / plain_rate) * 100);
+            }
+        }
+
+        if (udp_flag) {
+            size_t datagrams = 0;
+            size_t lost = 0;
+            size_t late = 0;
+            size_t dups = 0;
+            unsigned long senders = 0;
+            int i;
+
+            for (i = 0; i < udp_nsocks; i++) {
+                datagrams += udp_workers[i].datagrams;
+                lost += udp_workers[i].lost;
+                late += udp_workers[i].late;
+                dups += udp_workers[i].dups;
+                senders += udp_workers[i].nsenders;
+            }
+
+            lost = lost > late ? lost - late : 0;
+            info("UDP: %zu datagrams from %lu agents (%f Kdps).", datagrams, senders, perf_eps(datagrams / 1000.0, c_diff));
+            info("UDP: %zu datagrams lost (%.3f%%), %zu out of order, %zu duplicates.", lost, datagrams + lost ? lost * 100.0 / (datagrams + lost) : 0, late, dups);
+        }
+
+        if (push_timer >= 0) {
+            info("Data pushed: %zu messages, %zu MB (%f Mbps).", push_sent, push_bytes / 1000000, perf_bps(push_bytes, c_diff) / 1000000);
+            info("Pushes dropped: %zu. Largest output queue: %zu bytes.", push_dropped, push_queued_max);
+        }
+
+        if (service_latency.total) {
+            // Connections still open count too
+
+            for (i = 0; netbuffer.buffers && i <= netbuffer.max_fd; i++) {
+                if (netbuffer.buffers[i].open && netbuffer.buffers[i].latency_max) {
+                    latency_add(&conn_latency, netbuffer.buffers[i].latency_max);
+                }
+            }
+
+            if (sched_quantum) {
+                info("Scheduler: %zu turns, %zu cut by the quota (%ld bytes, %zu events).", sched_turns, sched_cut, sched_quantum, sched_events);
+            }
+
+            latency_report("Service latency", &service_latency);
+            latency_report("Worst service latency per connection", &conn_latency);
+        }
+    }
+}
+
+// Create the listening socket
+
+static int tcp_listen(int reuseport) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr = { .s_addr = htonl(INADDR_ANY) } };
+    int sock;
+
+    debug("socket()");
+    if (sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP), sock < 0) {
+        error2("socket()");
+        return -1;
+    }
+
+    {
+        int flag = 1;
+
+        debug("setsockopt(REUSEADDR)");
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0) {
+            error2("setsockopt(REUSEADDR)");
+            close(sock);
+            return -1;
+        }
+    }
+
+    if (timeout.tv_sec || timeout.tv_usec) {
+        debug("setsockopt(SO_RCVTIMEO)");
+
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+            error2("setsockopt(SO_RCVTIMEO)");
+            close(sock);
+            return -1;
+        }
+    }
+
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 }, sizeof(int)) < 0) {
+        error2("setsockopt(SO_REUSEPORT)");
+        close(sock);
+        return -1;
+    }
+
+    // Accepted connections inherit the options of the listening socket
+
+    if (so_apply(&sockopts, sock, 1) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    debug("bind(%hu)", port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        error2("bind()");
+        close(sock);
+        return -1;
+    }
+
+    debug("listen(%d)", SOMAXCONN);
+    if (listen(sock, SOMAXCONN) < 0) {
+        error2("listen()");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// Several event loops: one process per CPU, each one with its own socket of a SO_REUSEPORT group.
+// Returns the socket of the worker in the children, and 0 in the parent.
+
+static int workers_start() {
+    int * socks = malloc(sizeof(int) * nloop_cpus);
+    pid_t pid;
+    int i;
+    int j;
+
+    if (workers = mmap(NULL, sizeof(worker_t) * nloop_cpus, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0), workers == MAP_FAILED) {
+        error2("mmap()");
+        return -1;
+    }
+
+    for (i = 0; i < nloop_cpus; i++) {
+        if (socks[i] = tcp_listen(1), socks[i] < 0) {
+            return -1;
+        }
+
+        workers[i].cpu = loop_cpus[i];
+        workers[i].node = cpu_node(loop_cpus[i]);
+    }
+
+    if (steer_attach(socks[0]) < 0) {
+        return -1;
+    }
+
+    // Without one of its loops, the reuseport group no longer matches the steering program: the parent stops
+
+    signal(SIGCHLD, handler);
+
+    for (i = 0; i < nloop_cpus; i++) {
+        // Only the parent writes the pid: the shared slot must not be overwritten with the child's 0
+
+        switch (pid = fork(), pid) {
+        case -1:
+            error2("fork()");
+            return -1;
+
+        default:
+            workers[i].pid = pid;
+            break;
+
+        case 0:
+            signal(SIGCHLD, SIG_DFL);
+            worker_id = i;
+            self = workers + i;
+
+            for (j = 0; j < nloop_cpus; j++) {
+                if (j != i) {
+                    close(socks[j]);
+                }
+            }
+
+            i = socks[i];
+            free(socks);
+
+            if (cpu_pin(self->cpu) < 0) {
+                exit(EXIT_FAILURE);
+            }
+
+            return i;
         }
     }
 
+    for (i = 0; i < nloop_cpus; i++) {
+        close(socks[i]);
+    }
+
+    free(socks);
     return 0;
 }
 
+// Parent of the worker processes: watch them, and report the aggregate when they are done
+
+static int workers_main() {
+    struct timespec c_end;
+    int status;
+    int retval = EXIT_SUCCESS;
+    int i;
+
+    if (watch_interval.tv_sec || watch_interval.tv_nsec) {
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, 1);
+
+        if (pthread_create(&thread, &attr, monitor, NULL) < 0) {
+            error("pthread_create(monitor)");
+        }
+
+        pthread_attr_destroy(&attr);
+    }
+
+    while (running) {
+        pause();
+    }
+
+    signal(SIGCHLD, SIG_DFL);
+
+    for (i = 0; i < nloop_cpus; i++) {
+        kill(workers[i].pid, SIGINT);
+    }
+
+    for (i = 0; i < nloop_cpus; i++) {
+        if (waitpid(workers[i].pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            warn("Loop %d (pid %d) failed.", i, workers[i].pid);
+            retval = EXIT_FAILURE;
+        }
+
+        acc_bytes += workers[i].bytes;
+        acc_events += workers[i].events;
+
+        if (workers[i].c_begin.tv_sec && (!c_begin.tv_sec || timediff(&workers[i].c_begin, &c_begin).tv_sec < 0)) {
+            c_begin = workers[i].c_begin;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &c_end);
+    summary(&c_end);
+    verbose("Exiting.");
+    return retval;
+}
+
+// UDP mode: one thread per SO_REUSEPORT socket. Returns the exit status.
+
+static int udp_main() {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr = { .s_addr = htonl(INADDR_ANY) } };
+    struct timespec c_end;
+    pthread_t thread;
+    int i;
+
+    // With a CPU list, there is one socket and one pinned thread per CPU
+
+    if (nloop_cpus) {
+        udp_nsocks = nloop_cpus;
+    }
+
+    udp_workers = calloc(udp_nsocks, sizeof(udp_worker_t));
+
+    for (i = 0; i < udp_nsocks; i++) {
+        udp_workers[i].cpu = nloop_cpus ? loop_cpus[i] : -1;
+
+        debug("socket(UDP)");
+        if (udp_workers[i].sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP), udp_workers[i].sock < 0) {
+            error2("socket(UDP)");
+            return EXIT_FAILURE;
+        }
+
+        if (setsockopt(udp_workers[i].sock, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 }, sizeof(int)) < 0) {
+            error2("setsockopt(SO_REUSEPORT)");
+            return EXIT_FAILURE;
+        }
+
+        if (so_apply(&sockopts, udp_workers[i].sock, 0) < 0) {
+            return EXIT_FAILURE;
+        }
+
+        if (udp_gro && setsockopt(udp_workers[i].sock, SOL_UDP, UDP_GRO, &(int){ 1 }, sizeof(int)) < 0) {
+            error2("setsockopt(UDP_GRO)");
+            return EXIT_FAILURE;
+        }
+
+        debug("bind(%hu)", port);
+        if (bind(udp_workers[i].sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            error2("bind()");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // No CPU steering: the kernel's flow hash keeps each sender, and its sequence table, on one thread
+
+    if (watch_interval.tv_sec || watch_interval.tv_nsec) {
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, 1);
+
+        if (pthread_create(&thread, &attr, monitor, NULL) < 0) {
+            error("pthread_create(monitor)");
+            return EXIT_FAILURE;
+        }
+
+        pthread_attr_destroy(&attr);
+    }
+
+    for (i = 0; i < udp_nsocks; i++) {
+        if (pthread_create(&udp_workers[i].thread, NULL, udp_worker, udp_workers + i) != 0) {
+            error("pthread_create(udp_worker)");
+            return EXIT_FAILURE;
+        }
+    }
+
+    while (running) {
+        pause();
+    }
+
+    for (i = 0; i < udp_nsocks; i++) {
+        pthread_join(udp_workers[i].thread, NULL);
+        close(udp_workers[i].sock);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &c_end);
+    summary(&c_end);
+    verbose("Exiting.");
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char ** argv) {
-    int sock;
-    int epfd;
+    int sock = -1;
     int nevents;
     int i;
-    long nrecv;
-    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr = { .s_addr = htonl(INADDR_ANY) } };
     struct epoll_event request = { .events = EPOLLIN };
     struct epoll_event events[POLL_SIZE] = { { .events = 0 } };
     struct timespec c_end;
     struct timespec c_diff;
+    uint64_t c_ready;
 
     options(argc, argv);
+    saved_argv = argv;
     signal(SIGINT, handler);
     signal(SIGPIPE, handler);
+    signal(SIGUSR2, handler);
+    numa_init();
 
-    addr.sin_port = htons(port);
-
-    debug("socket()");
-    if (sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP), sock < 0) {
-        error2("socket()");
-        return EXIT_FAILURE;
-    }
+    if (nloop_cpus) {
+        sched_getaffinity(0, sizeof(cpus_allowed), &cpus_allowed);
 
-    {
-        int flag = 1;
+        // A loop that cannot be pinned would leave the reuseport group, and the steering program would misroute
 
-        debug("setsockopt(REUSEADDR)");
-        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0) {
-            error2("setsockopt(REUSEADDR)");
-            return EXIT_FAILURE;
+        for (i = 0; i < nloop_cpus; i++) {
+            if (!CPU_ISSET(loop_cpus[i], &cpus_allowed)) {
+                error("CPU %d of option -C does not exist or is not allowed for this process.", loop_cpus[i]);
+                return EXIT_FAILURE;
+            }
         }
-    }
 
-    if (timeout.tv_sec || timeout.tv_usec) {
-        debug("setsockopt(SO_RCVTIMEO)");
+        if (nloop_cpus == 1 && !udp_flag) {
+            single.cpu = loop_cpus[0];
+            single.node = cpu_node(single.cpu);
 
-        if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-            error2("setsockopt(SO_RCVTIMEO)");
-            return EXIT_FAILURE;
+            if (cpu_pin(single.cpu) < 0) {
+                return EXIT_FAILURE;
+            }
         }
     }
 
-    debug("bind(%hu)", port);
-    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        error2("bind()");
-        return EXIT_FAILURE;
+    if (udp_flag) {
+        return udp_main();
     }
 
-    debug("listen(%d)", SOMAXCONN);
-    if (listen(sock, SOMAXCONN) < 0) {
-        error2("listen()");
+    // Before forking the loops: they share the certificate and the session ticket keys, so that
+    // a ticket issued by one loop resumes on another
+
+    if (tls_flag && (tls_ctx = tls_init(), !tls_ctx)) {
         return EXIT_FAILURE;
     }
 
+    if (getenv(HANDOFF_ENV)) {
+        handoff_fd = atoi(getenv(HANDOFF_ENV));
+        unsetenv(HANDOFF_ENV);
+    } else {
+        if (nloop_cpus > 1) {
+            if (sock = workers_start(), sock < 0) {
+                return EXIT_FAILURE;
+            } else if (worker_id < 0) {
+                return workers_main();
+            }
+        } else if (sock = tcp_listen(0), sock < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    ack_buffer = sb_new(strdup(HC_ACK), strlen(HC_ACK), -1);
+
     if (epfd = epoll_create(POLL_SIZE), epfd < 0) {
         error2("epoll_create()");
         return EXIT_FAILURE;
     }
 
+    if (handoff_fd >= 0 && (sock = handoff_receive(), sock < 0)) {
+        return EXIT_FAILURE;
+    }
+
     request.data.fd = sock;
 
     if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &request) < 0) {
@@ -299,7 +2428,55 @@ int main(int argc, char ** argv) {
         return EXIT_FAILURE;
     }
 
-    if (watch_interval.tv_sec || watch_interval.tv_nsec) {
+    if (push_interval.tv_sec || push_interval.tv_nsec) {
+        struct itimerspec spec = { push_interval, push_interval };
+
+        if (push_buffer = push_file ? push_load() : push_generate(), !push_buffer) {
+            return EXIT_FAILURE;
+        }
+
+        if (push_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK), push_timer < 0) {
+            error2("timerfd_create()");
+            return EXIT_FAILURE;
+        }
+
+        if (timerfd_settime(push_timer, 0, &spec, NULL) < 0) {
+            error2("timerfd_settime()");
+            return EXIT_FAILURE;
+        }
+
+        request.data.fd = push_timer;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, push_timer, &request) < 0) {
+            error2("epoll_ctl() [3]");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (info_timer == 0) {
+        struct itimerspec spec = { watch_interval, watch_interval };
+
+        if (info_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK), info_timer < 0) {
+            error2("timerfd_create()");
+            return EXIT_FAILURE;
+        }
+
+        if (timerfd_settime(info_timer, 0, &spec, NULL) < 0) {
+            error2("timerfd_settime()");
+            return EXIT_FAILURE;
+        }
+
+        request.data.fd = info_timer;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, info_timer, &request) < 0) {
+            error2("epoll_ctl() [6]");
+            return EXIT_FAILURE;
+        }
+
+        tcp_sample();
+    }
+
+    if ((watch_interval.tv_sec || watch_interval.tv_nsec) && worker_id < 0) {
         pthread_t thread;
         pthread_attr_t attr;
 
@@ -315,7 +2492,12 @@ int main(int argc, char ** argv) {
     }
 
     while (running) {
-        nevents = epoll_wait(epfd, events, POLL_SIZE, -1);
+        nevents = epoll_wait(epfd, events, POLL_SIZE, runqueues[0].len || runqueues[1].len ? 0 : -1);
+
+        if (restart) {
+            restart = 0;
+            handoff_start();
+        }
 
         if (nevents < 0) {
             if (errno != EINTR) {
@@ -326,20 +2508,68 @@ int main(int argc, char ** argv) {
         }
 
         debug("New events: %d", nevents);
+        c_ready = now_ns();
 
         if (!c_begin.tv_sec) {
             clock_gettime(CLOCK_MONOTONIC, &c_begin);
+            self->c_begin = c_begin;
+        }
+
+        // Keep the event rate of the last second, to measure the throughput dip of a hot restart
+
+        if (clock_gettime(CLOCK_MONOTONIC, &c_end), c_end.tv_sec - rate_mark.tv_sec >= 1) {
+            rate_prev = rate_mark;
+            rate_prev_events = rate_events;
+            rate_mark = c_end;
+            rate_events = acc_events;
+
+            if (resume_mark.tv_sec && c_end.tv_sec - resume_mark.tv_sec >= 1) {
+                double eps;
+
+                c_diff = timediff(&c_end, &resume_mark);
+                eps = perf_eps((double)(acc_events - resume_events), c_diff);
+                info("Hot restart: throughput %f Keps before, %f Keps after (%+.2f%%).", resume_eps / 1000, eps / 1000, resume_eps ? (eps / resume_eps - 1) * 100 : 0);
+                resume_mark.tv_sec = 0;
+            }
         }
 
+        self->bytes = acc_bytes;
+        self->events = acc_events;
+        self->tls_full = tls_full;
+        self->tls_resumed = tls_resumed;
+
         for (i = 0; i < nevents; i++) {
-            if (events[i].data.fd == sock) {
+            if (events[i].data.fd == handoff_fd) {
+                if (handoff_send(sock) == 0) {
+                    return EXIT_SUCCESS;
+                }
+            } else if (events[i].data.fd == info_timer) {
+                uint64_t expirations;
+
+                if (read(info_timer, &expirations, sizeof(expirations)) > 0) {
+                    tcp_sample();
+                }
+            } else if (events[i].data.fd == push_timer) {
+                uint64_t expirations;
+
+                if (read(push_timer, &expirations, sizeof(expirations)) > 0) {
+                    broadcast();
+                }
+            } else if (events[i].data.fd == sock) {
                 debug("accept()");
-                if (request.data.fd = accept(sock, NULL, NULL), request.data.fd < 0) {
+                if (request.data.fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK), request.data.fd < 0) {
                     error2("accept()");
                     continue;
                 }
 
                 nb_open(&netbuffer, request.data.fd);
+                conn_incoming(request.data.fd);
+                request.events = conn_events;
+
+                if (tls_flag) {
+                    netbuffer.buffers[request.data.fd].transport = TR_PENDING;
+                }
+
                 verbose("New connection: %d (%d)", request.data.fd, nconn);
 
                 if (epoll_ctl(epfd, EPOLL_CTL_ADD, request.data.fd, &request) < 0) {
@@ -347,55 +2577,77 @@ int main(int argc, char ** argv) {
                     nb_close(&netbuffer, request.data.fd);
                 }
             } else {
-                nrecv = nb_recv(&netbuffer.buffers[events[i].data.fd], events[i].data.fd, dispatch);
+                sockbuffer_t * buffer = &netbuffer.buffers[events[i].data.fd];
 
-                switch (nrecv) {
-                case -1:
-                    switch (errno) {
-                    case ECONNRESET:
-                        verbose("Socket %d closed (%d).", events[i].data.fd, nconn);
-                        break;
-
-                    default:
-                        error2("recv(%d)", events[i].data.fd);
+                if (events[i].events & EPOLLOUT) {
+                    if (nb_flush(buffer, events[i].data.fd) < 0) {
+                        verbose("Socket %d closed while sending (%d).", events[i].data.fd, nconn);
+                        nb_close(&netbuffer, events[i].data.fd);
+                        continue;
                     }
 
-                    nb_close(&netbuffer, events[i].data.fd);
-                    break;
+                    if (!(events[i].events & ~EPOLLOUT)) {
+                        continue;
+                    }
+                }
 
-                case 0:
+                if (!buffer->queued) {
+                    buffer->ready = c_ready;
 
-                    nb_close(&netbuffer, events[i].data.fd);
-                    break;
+                    if (sched_quantum) {
+                        rq_push(events[i].data.fd);
+                    } else {
+                        conn_service(events[i].data.fd);
+                    }
                 }
             }
         }
+
+        if (sched_quantum) {
+            sched_round();
+        }
     }
 
     clock_gettime(CLOCK_MONOTONIC, &c_end);
 
     close(sock);
     close(epfd);
-    info("Data received: %zu events, %zu MB", acc_events, acc_bytes / 1000000);
+    SSL_CTX_free(tls_ctx);
 
-    if (c_begin.tv_sec) {
-        c_diff = timediff(&c_end, &c_begin);
-        info("Time: %f sec.", (c_diff.tv_sec + (double)c_diff.tv_nsec / 1000000000));
-        info("Performance: %f Mbps.", perf_bps(acc_bytes, c_diff) / 1000000);
-        info("Throughput: %f Keps.", perf_eps(acc_events / 1000, c_diff));
+    if (push_timer >= 0) {
+        close(push_timer);
+    }
+
+    if (info_timer >= 0) {
+        close(info_timer);
+    }
+
+    self->bytes = acc_bytes;
+    self->events = acc_events;
+
+    if (worker_id >= 0) {
+        info("Loop %d (CPU %d):", worker_id, self->cpu);
     }
 
+    summary(&c_end);
     verbose("Exiting.");
     return EXIT_SUCCESS;
 }
 
 void nb_open(netbuffer_t * buffer, int sock) {
-    if (sock >= buffer->max_fd) {
+    if (!buffer->buffers || sock > buffer->max_fd) {
+        int first = buffer->buffers ? buffer->max_fd + 1 : 0;
+
+        // Scans trust every slot: the new ones, up to this socket, must not look like connections
+
         buffer->buffers = realloc(buffer->buffers, sizeof(sockbuffer_t) * (sock + 1));
+        memset(buffer->buffers + first, 0, sizeof(sockbuffer_t) * (sock + 1 - first));
         buffer->max_fd = sock;
     }
 
     memset(buffer->buffers + sock, 0, sizeof(sockbuffer_t));
+    buffer->buffers[sock].open = 1;
+    buffer->buffers[sock].opened = now_ns();
     ++nconn;
 }
 
@@ -406,7 +2658,26 @@ int nb_close(netbuffer_t * buffer, int sock) {
         error2("close(%d)", sock);
         exit(1);
     } else {
+        outqueue_t * node;
+
+        while (node = buffer->buffers[sock].out_head, node) {
+            buffer->buffers[sock].out_head = node->next;
+            sb_release(node->buffer);
+            free(node);
+        }
+
+        if (buffer->buffers[sock].queued) {
+            rq_remove(sock);
+        }
+
+        if (buffer->buffers[sock].latency_max) {
+            latency_add(&conn_latency, buffer->buffers[sock].latency_max);
+        }
+
+        bulk_account(buffer->buffers + sock);
+
         free(buffer->buffers[sock].data);
+        SSL_free(buffer->buffers[sock].ssl);
         memset(buffer->buffers + sock, 0, sizeof(sockbuffer_t));
         --nconn;
     }
@@ -414,58 +2685,155 @@ int nb_close(netbuffer_t * buffer, int sock) {
     return retval;
 }
 
-int nb_recv(sockbuffer_t * buffer, int sock, int (*callback)(int sock, char * data, unsigned long)) {
-    unsigned long data_ext = buffer->data_len + BUF_SIZE;
+int nb_recv(sockbuffer_t * buffer, int sock, unsigned long size, int (*callback)(int sock, char * data, unsigned long)) {
     long recv_len;
-    unsigned long i;
-    unsigned long cur_offset;
-    uint32_t cur_len;
-    int retval = 0;
-
-    // Extend data buffer
+    int retval;
 
-    if (data_ext > buffer->data_size) {
-        buffer->data = realloc(buffer->data, data_ext);
-        buffer->data_size = data_ext;
-    }
+    nb_reserve(buffer, size);
 
     // Receive and append
 
-    recv_len = recv(sock, buffer->data + buffer->data_len, BUF_SIZE, 0);
+    if (buffer->ssl) {
+        recv_len = tls_recv(buffer->ssl, buffer->data + buffer->data_len, size);
+    } else {
+        recv_len = recv(sock, buffer->data + buffer->data_len, size, 0);
+    }
 
     if (recv_len <= 0) {
         return recv_len;
     }
 
     acc_bytes += recv_len;
+
+    if (buffer->remote) {
+        self->remote_bytes += recv_len;
+    }
+
+    if (buffer->ssl) {
+        tls_bytes += recv_len;
+    }
+
     buffer->data_len += recv_len;
+    retval = nb_frame(buffer, sock, callback);
+    return retval ? retval : recv_len;
+}
 
-    // Dispatch as most messages as possible
+// Append a shared message to the output queue and try to send it right away
 
-    for (i = 0; i + sizeof(uint32_t) <= buffer->data_len && !retval; i = cur_offset + cur_len) {
-        cur_len = *(uint32_t *)(buffer->data + i);
-        cur_offset = i + sizeof(uint32_t);
+int nb_send(sockbuffer_t * buffer, int sock, shbuffer_t * shared) {
+    outqueue_t * node = malloc(sizeof(outqueue_t));
 
-        if (cur_offset + cur_len > buffer->data_len) {
-            break;
-        }
+    node->buffer = shared;
+    node->offset = 0;
+    node->next = NULL;
+    shared->refs++;
+
+    if (buffer->out_tail) {
+        buffer->out_tail->next = node;
+    } else {
+        buffer->out_head = node;
+    }
+
+    buffer->out_tail = node;
+    buffer->out_len += sizeof(uint32_t) + shared->size;
 
-        retval = callback(sock, buffer->data + cur_offset, cur_len);
-        recv_len = cur_len;
+    if (buffer->out_len > push_queued_max) {
+        push_queued_max = buffer->out_len;
     }
 
-    // Move remaining data to data start
+    // A previous message is waiting for EPOLLOUT
+
+    return buffer->out_head != node ? 0 : nb_flush(buffer, sock);
+}
+
+// Send as much queued data as the socket accepts. Watch EPOLLOUT while data remains.
+
+int nb_flush(sockbuffer_t * buffer, int sock) {
+    struct epoll_event request = { .events = conn_events, .data = { .fd = sock } };
+    struct iovec iov[2];
+    outqueue_t * node;
+    shbuffer_t * shared;
+    unsigned long offset;
+    long nsend;
+
+    while (node = buffer->out_head, node) {
+        shared = node->buffer;
+        offset = node->offset;
+
+        if (offset < sizeof(uint32_t)) {
+            iov[0].iov_base = (char *)&shared->header + offset;
+            iov[0].iov_len = sizeof(uint32_t) - offset;
+            iov[1].iov_base = shared->data;
+            iov[1].iov_len = shared->size;
+
+            if (buffer->ssl) {
+                nsend = tls_send(buffer->ssl, iov[0].iov_base, iov[0].iov_len);
+            } else if (shared->fd >= 0) {
+                nsend = send(sock, iov[0].iov_base, iov[0].iov_len, MSG_MORE);
+            } else {
+                nsend = writev(sock, iov, 2);
+            }
+        } else {
+            off_t file_offset = offset - sizeof(uint32_t);
+            unsigned long left = shared->size - file_offset;
+
+            if (buffer->ssl && shared->fd >= 0 && BIO_get_ktls_send(SSL_get_wbio(buffer->ssl))) {
+                nsend = SSL_sendfile(buffer->ssl, shared->fd, file_offset, left, 0);
+            } else if (buffer->ssl) {
+                nsend = tls_send(buffer->ssl, shared->data + file_offset, left);
+            } else if (shared->fd >= 0) {
+                nsend = sendfile(sock, shared->fd, &file_offset, left);
+            } else {
+                nsend = send(sock, shared->data + file_offset, left, 0);
+            }
+        }
+
+        if (nsend < 0) {
+            if (errno == EAGAIN) {
+                break;
+            }
+
+            return -1;
+        }
+
+        // Nothing sent while data remains: retrying would never progress
+
+        if (nsend == 0) {
+            errno = EIO;
+            return -1;
+        }
 
-    if (i > 0) {
-        debug("i = %lu, len = %lu, size = %lu", i, buffer->data_len, buffer->data_size);
+        node->offset += nsend;
+        buffer->out_len -= nsend;
 
-        if (i < buffer->data_len) {
-            debug("moving %d bytes", (int)(buffer->data_len - i));
-            memcpy(buffer->data, buffer->data + i, buffer->data_len - i);
+        if (shared != ack_buffer) {
+            push_bytes += nsend;
         }
 
-        buffer->data_len -= i;
+        if (node->offset == sizeof(uint32_t) + shared->size) {
+            if (shared != ack_buffer) {
+                ++push_sent;
+            }
+
+            buffer->out_head = node->next;
+            sb_release(shared);
+            free(node);
+        }
     }
 
-    return retval ? retval : recv_len;
+    if (!buffer->out_head) {
+        buffer->out_tail = NULL;
+    }
+
+    if ((buffer->out_head != NULL) != buffer->pollout) {
+        buffer->pollout = buffer->out_head != NULL;
+        request.events |= buffer->pollout ? EPOLLOUT : 0;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, sock, &request) < 0) {
+            error2("epoll_ctl(%d) [4]", sock);
+            return -1;
+        }
+    }
+
+    return 0;
 }
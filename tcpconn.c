@@ -0,0 +1,146 @@
+#define TCPCONN_LIBRARY
+#include "tcpconn.h"
+
+nb_stats_t nb_stats;
+
+static const struct {
+    const char * name;
+    int level;
+    int optname;
+    int boolean;
+} SOCKOPTS[SOCKOPT_COUNT] = {
+    { "rcvbuf", SOL_SOCKET, SO_RCVBUF, 0 },
+    { "sndbuf", SOL_SOCKET, SO_SNDBUF, 0 },
+    { "busy_poll", SOL_SOCKET, SO_BUSY_POLL, 0 },
+    { "nodelay", IPPROTO_TCP, TCP_NODELAY, 1 },
+    { "cork", IPPROTO_TCP, TCP_CORK, 1 },
+    { "notsent_lowat", IPPROTO_TCP, TCP_NOTSENT_LOWAT, 0 }
+};
+
+// Parse "<name>[=<value>]". Returns 0 on success, or -1 on error.
+
+int so_parse(sockopts_t * opts, const char * arg) {
+    const char * value = strchr(arg, '=');
+    size_t length = value ? (size_t)(value - arg) : strlen(arg);
+    int i;
+
+    for (i = 0; i < SOCKOPT_COUNT; i++) {
+        if (strlen(SOCKOPTS[i].name) == length && strncmp(SOCKOPTS[i].name, arg, length) == 0) {
+            break;
+        }
+    }
+
+    if (i == SOCKOPT_COUNT) {
+        error("Unknown socket option '%.*s'.", (int)length, arg);
+        return -1;
+    }
+
+    if (!value && !SOCKOPTS[i].boolean) {
+        error("Socket option '%s' needs a value.", SOCKOPTS[i].name);
+        return -1;
+    }
+
+    if (opts->values[i] = value ? atoi(value + 1) : 1, opts->values[i] < 0) {
+        error("Socket option '%s' needs a nonnegative value.", SOCKOPTS[i].name);
+        return -1;
+    }
+
+    opts->set[i] = 1;
+    return 0;
+}
+
+// Apply the parsed options to a socket (TCP-level ones only if tcp is set). Returns 0 on success, or -1 on error.
+
+int so_apply(const sockopts_t * opts, int sock, int tcp) {
+    int i;
+
+    for (i = 0; i < SOCKOPT_COUNT; i++) {
+        if (!opts->set[i] || (SOCKOPTS[i].level == IPPROTO_TCP && !tcp)) {
+            continue;
+        }
+
+        if (setsockopt(sock, SOCKOPTS[i].level, SOCKOPTS[i].optname, &opts->values[i], sizeof(int)) < 0) {
+            error2("setsockopt(%s=%d)", SOCKOPTS[i].name, opts->values[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Monotonic clock, in nanoseconds
+
+uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Add a sample to a latency histogram
+
+void latency_add(latency_t * hist, uint64_t ns) {
+    int shift = ns < 16 ? 0 : 59 - __builtin_clzll(ns);
+
+    hist->counts[shift * 16 + (ns >> shift)]++;
+    hist->total++;
+
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+}
+
+// Lower bound of the bucket that holds the given quantile, in microseconds
+
+double latency_quantile(const latency_t * hist, double q) {
+    size_t target = q * hist->total;
+    size_t count = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS - 1 && (count += hist->counts[i]) <= target; i++);
+    return (i < 32 ? (uint64_t)i : (uint64_t)(i % 16 + 16) << (i / 16 - 1)) / 1000.0;
+}
+
+// Make room for size more bytes in the receive buffer
+
+void nb_reserve(sockbuffer_t * buffer, unsigned long size) {
+    unsigned long data_ext = buffer->data_len + size;
+
+    if (data_ext > buffer->data_size) {
+        buffer->data = realloc(buffer->data, data_ext);
+        buffer->data_size = data_ext;
+        nb_stats.allocs++;
+    }
+}
+
+// Dispatch every complete message in the receive buffer, and move the remaining data to its start.
+// Returns 0, or the first nonzero value returned by the callback (later messages are not dispatched).
+
+int nb_frame(sockbuffer_t * buffer, int sock, int (*callback)(int sock, char * data, unsigned long)) {
+    unsigned long i;
+    unsigned long cur_offset;
+    uint32_t cur_len;
+    int retval = 0;
+
+    for (i = 0; i + sizeof(uint32_t) <= buffer->data_len && !retval; i = cur_offset + cur_len) {
+        cur_len = *(uint32_t *)(buffer->data + i);
+        cur_offset = i + sizeof(uint32_t);
+
+        if (cur_offset + cur_len > buffer->data_len) {
+            break;
+        }
+
+        retval = callback(sock, buffer->data + cur_offset, cur_len);
+    }
+
+    if (i > 0) {
+        if (i < buffer->data_len) {
+            memmove(buffer->data, buffer->data + i, buffer->data_len - i);
+            nb_stats.moved += buffer->data_len - i;
+        }
+
+        buffer->data_len -= i;
+    }
+
+    return retval;
+}
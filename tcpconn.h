@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
@@ -10,10 +13,30 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
 
 #define DEF_PORT 1516
 #define POLL_SIZE 100
@@ -24,21 +47,180 @@
 #define error2(format, ...) fprintf(stderr, "\e[31mERROR (%d)\e[0m: " format ": %s (%d)\n", (int)getpid(), ##__VA_ARGS__, strerror(errno), errno)
 #define warn(format, ...) fprintf(stderr, "\e[33mWARN (%d)\e[0m: " format "\n", (int)getpid(), ##__VA_ARGS__)
 #define warn2(format, ...) fprintf(stderr, "\e[33mWARN (%d)\e[0m: " format ": %s (%d)\n", (int)getpid(), ##__VA_ARGS__, strerror(errno), errno)
+#define error_tls(format, ...) fprintf(stderr, "\e[31mERROR (%d)\e[0m: " format ": %s\n", (int)getpid(), ##__VA_ARGS__, ERR_error_string(ERR_get_error(), NULL))
+#define warn_tls(format, ...) fprintf(stderr, "\e[33mWARN (%d)\e[0m: " format ": %s\n", (int)getpid(), ##__VA_ARGS__, ERR_error_string(ERR_get_error(), NULL))
 #define info(format, ...) fprintf(stderr, "\e[32mINFO (%d)\e[0m: " format "\n", (int)getpid(), ##__VA_ARGS__)
 #define debug(format, ...) if (debug_flag) fprintf(stderr, "\e[34mDEBUG (%d)\e[0m: " format "\n", (int)getpid(), ##__VA_ARGS__)
 #define verbose(format, ...) if (verbose_flag) printf("\e[32mINFO (%d)\e[0m: " format "\n", (int)getpid(), ##__VA_ARGS__)
 
-static const char * HC_STARTUP = "HC_STARTUP";
-static const char * HC_ACK = "HC_ACK";
+static const char * HC_STARTUP __attribute__ ((unused)) = "HC_STARTUP";
+static const char * HC_ACK __attribute__ ((unused)) = "HC_ACK";
+
+// First byte of a TLS record carrying a handshake message (ClientHello)
+#define TLS_RECORD_HANDSHAKE 0x16
 
+// Every program defines its own help (not tcpconn.c)
+#ifndef TCPCONN_LIBRARY
 static void help(const char * argv0, int result) __attribute__ ((noreturn));
+#endif
+
+typedef enum transport_t {
+    TR_PLAIN,       // Plaintext TCP
+    TR_PENDING,     // Not yet known: waiting for the first byte
+    TR_TLS          // TLS over TCP (see ssl)
+} transport_t;
+
+// Immutable, reference-counted message shared by many output queues
+
+typedef struct shbuffer_t {
+    unsigned long refs;
+    uint32_t header;        // Message length, sent before data
+    char * data;            // Heap memory, or mapping of fd
+    unsigned long size;
+    int fd;                 // File for sendfile(), or -1
+} shbuffer_t;
+
+typedef struct outqueue_t {
+    shbuffer_t * buffer;
+    unsigned long offset;   // Bytes already sent, including header
+    struct outqueue_t * next;
+} outqueue_t;
 
 typedef struct sockbuffer_t {
     char * data;
     unsigned long data_size;
     unsigned long data_len;
+    transport_t transport;
+    SSL * ssl;
+    int open;
+    int remote;             // Packets arrive on another NUMA node
+    int handshaked;
+    outqueue_t * out_head;
+    outqueue_t * out_tail;
+    unsigned long out_len;  // Bytes pending in the output queue
+    int pollout;            // Watching EPOLLOUT
+    int queued;             // In a run queue: class + 1
+    int prev;               // Run queue links
+    int next;
+    long deficit;           // Byte credit (deficit round-robin)
+    uint64_t ready;         // Time when it became ready (ns)
+    uint64_t latency_max;   // Worst service latency (ns)
+    uint64_t opened;        // Time when it was accepted (ns)
+    size_t bulk_bytes;      // Bytes in data messages (after the handshake)
 } sockbuffer_t;
 
+// Fair-share scheduling: ready connections wait in one run queue per class
+
+#define SCHED_CLASSES 2
+
+typedef struct runqueue_t {
+    int head;
+    int tail;
+    unsigned long len;
+} runqueue_t;
+
+// Latency histogram: 16 linear sub-buckets per power of two of nanoseconds
+
+#define LATENCY_BUCKETS 1024
+
+typedef struct latency_t {
+    size_t counts[LATENCY_BUCKETS];
+    size_t total;
+    uint64_t max;
+} latency_t;
+
+// UDP mode: every datagram starts with this header, followed by one or more messages
+
+#define UDP_BATCH 64
+#define UDP_MAX 65507
+
+typedef struct udp_header_t {
+    uint32_t agent;         // Random sender id
+    uint32_t seq;           // Datagram sequence number, per sender
+} udp_header_t;
+
+typedef struct udp_sender_t {
+    uint32_t agent;
+    uint32_t next;          // Expected sequence number
+    uint64_t seen;          // Bit i: datagram next - 1 - i arrived
+    int used;
+} udp_sender_t;
+
+typedef struct udp_worker_t {
+    int sock;
+    int cpu;                // Pinned CPU, or -1
+    pthread_t thread;
+    udp_sender_t * senders; // Open addressing table
+    unsigned long senders_size;
+    unsigned long nsenders;
+    volatile size_t datagrams;
+    volatile size_t lost;   // Sequence gaps
+    volatile size_t late;   // Counted lost, then arrived after a later datagram
+    volatile size_t dups;   // Arrived twice
+} udp_worker_t;
+
+// Hot restart: state passed to the new server process over a Unix socket
+
+#define HANDOFF_ENV "TCPCONN_HANDOFF_FD"
+#define HANDOFF_BATCH 64
+
+typedef struct handoff_header_t {
+    uint32_t nconn;
+    uint64_t acc_bytes;
+    uint64_t acc_events;
+    uint64_t push_sent;
+    uint64_t push_bytes;
+    struct timespec c_begin;
+    struct timespec c_stop;     // Old server stopped serving
+    double eps;                 // Throughput just before stopping
+} handoff_header_t;
+
+typedef struct handoff_conn_t {
+    int32_t transport;
+    int32_t handshaked;
+    uint64_t data_len;          // Received, not yet dispatched (follows)
+    uint64_t out_len;           // Queued, not yet sent (follows)
+} handoff_conn_t;
+
+// Event loops with -C: the CBPF steering program jumps with an 8-bit offset over one comparison per CPU
+
+#define STEER_MAX_CPUS 254
+
+// Event loop statistics, in shared memory when there are several worker processes
+
+typedef struct worker_t {
+    pid_t pid;
+    int cpu;
+    int node;
+    struct timespec c_begin;
+    volatile size_t bytes;
+    volatile size_t events;
+    volatile size_t conns;          // Accepted connections
+    volatile size_t local_cpu;      // ... whose packets arrive on the loop CPU
+    volatile size_t remote_node;    // ... whose packets arrive on another NUMA node
+    volatile size_t remote_bytes;   // Bytes received on those
+    volatile size_t tls_full;       // TLS handshakes
+    volatile size_t tls_resumed;
+} __attribute__ ((aligned (64))) worker_t;
+
+// Socket options set with -o <name>[=<value>]
+
+#define SOCKOPT_COUNT 6
+
+typedef struct sockopts_t {
+    int values[SOCKOPT_COUNT];
+    int set[SOCKOPT_COUNT];
+} sockopts_t;
+
+// Framing statistics: buffer allocations, and bytes moved to keep partial messages at the start
+
+typedef struct nb_stats_t {
+    size_t allocs;
+    size_t moved;
+} nb_stats_t;
+
+extern nb_stats_t nb_stats;
+
 typedef struct netbuffer_t {
     int max_fd;
     sockbuffer_t * buffers;
@@ -46,4 +228,13 @@ typedef struct netbuffer_t {
 
 void nb_open(netbuffer_t * buffer, int sock);
 int nb_close(netbuffer_t * buffer, int sock);
-int nb_recv(sockbuffer_t * buffer, int sock, int (*callback)(int sock, char * data, unsigned long));
+int nb_recv(sockbuffer_t * buffer, int sock, unsigned long size, int (*callback)(int sock, char * data, unsigned long));
+int nb_send(sockbuffer_t * buffer, int sock, shbuffer_t * shared);
+int nb_flush(sockbuffer_t * buffer, int sock);
+void nb_reserve(sockbuffer_t * buffer, unsigned long size);
+int nb_frame(sockbuffer_t * buffer, int sock, int (*callback)(int sock, char * data, unsigned long));
+int so_parse(sockopts_t * opts, const char * arg);
+int so_apply(const sockopts_t * opts, int sock, int tcp);
+uint64_t now_ns();
+void latency_add(latency_t * hist, uint64_t ns);
+double latency_quantile(const latency_t * hist, double q);